@@ -18,15 +18,89 @@
 
 #include <dirent.h>
 #include <fcntl.h>
+#include <float.h>
+#include <getopt.h>
+#include <inttypes.h>
 #include <limits.h>
+#include <math.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <errno.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 #include <unistd.h>
+#include "lighterjson.h"
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __linux__
+#include <sys/inotify.h>
+#include "shmring.h"
+#endif
+
+#define LJSON_CHUNK (1 << 20)     // minimum NDJSON chunk handed to a pool thread
+#define METRICS_INTERVAL 10       // seconds between rewrites of the metrics file
+#define WATCH_DEBOUNCE_MS 20      // quiet period before a batch of changed files is processed
+#define WATCH_BATCH 4096          // process a batch at this size even if events keep arriving
+#define WATCH_SEEN 4096           // remembered results of our own writes, to ignore their events
+#define KERNEL_SAMPLE 4096        // bytes inspected to choose a kernel
+#define KERNEL_INTERVAL (1 << 20) // bytes between samples
+#define STREAM_SPAN 4096          // default shortest move done with non-temporal stores
+#define STREAM_FILE (32 << 20)    // files smaller than this are moved through the cache
+#define STREAM_PREFETCH 512       // distance to prefetch ahead of a non-temporal move
+#define INDEX_VERSION 1
+#define INDEX_SPAN 256            // containers shorter than this are scanned instead of indexed
+#define INDEX_STRIDE 16           // array elements per index entry
+#define COLUMN_CHUNK (8 << 20)    // NDJSON bytes per thread in each round of --columns
+#define SPLIT_CHUNK (8 << 20)     // NDJSON bytes read into each buffer for --split-size
+
+// Scanning variants chosen per region from a sample of its content; the values are combinable flags
+typedef enum Kernel {Generic = 0, Strings = 1, Numbers = 2, Compact = Strings | Numbers} Kernel;
+#define KERNEL_COUNT 4
+
+typedef struct Key {
+  uint64_t hash; // hash of the current member name, or 0 in an array
+  int float32;   // whether numbers at this level are quantized
+} Key;
+
+typedef enum FieldKind {AnyValue, StringValue, NumberValue} FieldKind;
+
+// An expected member of NDJSON records. Offsets are into the template's bytes.
+typedef struct Field {
+  size_t name;            // as written, quotes included
+  size_t length;
+  size_t layout;          // everything from the end of the previous value to this one, as last seen
+  size_t layout_length;   // 0 if not learned
+  size_t minified;        // the layout as output: "{" or ",", the name and ":"
+  size_t minified_length;
+  int escaped;            // the name has escapes, which do_string may rewrite
+  FieldKind kind;
+} Field;
+
+// The members records are expected to have, in order; see do_record
+typedef struct Template {
+  Field* fields;
+  size_t count;
+  size_t size;
+  size_t tail;        // layout from the last value to the end of the line, which minifies to "}"
+  size_t tail_length; // 0 if not learned
+  uint8_t* bytes;     // names and layouts, followed by 16 readable bytes
+  size_t bytes_length;
+  size_t bytes_size;
+  int learn;          // learn from the next line whenever a line does not match
+  int valid;
+} Template;
 
 typedef struct File {
   uint8_t* data_start;
@@ -34,47 +108,266 @@ typedef struct File {
   uint8_t* windex;
   uint8_t* lindex;
   uint8_t* data_end;
+  const ljson_options* options;
+  Kernel kernel;
+  unsigned kernels;   // bit 1 << kernel for each kernel chosen so far
+  size_t next_sample; // offset from data_start at which to choose the kernel again
+  Key* keys;          // one per open container; only tracked for float32_keys
+  size_t key_depth;
+  size_t key_size;
+  size_t stream_span; // moves at least this long use non-temporal stores; 0 for never
+  Template* template;  // in NDJSON, the expected members of each line; NULL for none
+  uint64_t records;     // lines minified with the template
+  uint64_t record_hits; // of those, lines that matched it as learned from an earlier line or a schema
 } File;
 
 typedef struct Bitfield {
-  size_t size;
-  uint64_t* bits;
-  size_t bit_level;
-  size_t byte_level;
+  size_t size;    // allocated words
+  uint64_t* bits; // local until more than 64 levels are open
+  size_t depth;   // bits in use
   size_t current;
+  uint64_t local;
 } Bitfield;
 
 typedef enum Container {None = -1, Array, Object} Container;
 
-int64_t precision;
-int quiet;
-int newlines;
+typedef struct Progress {
+  char* path;
+  uint64_t offset;      // end of the last complete line already minified
+  uint64_t size;        // file size after that run
+  uint64_t inode;
+  uint64_t fingerprint; // hash of the minified bytes just before offset
+} Progress;
+
+typedef struct Column {
+  char* pointer;
+  int binary;   // native doubles, NaN where the value is missing or not a number; otherwise one JSON value per line
+  FILE* stream;
+} Column;
+
+// One thread's share of a round of --columns: whole lines, and the output for each column
+typedef struct ColumnChunk {
+  pthread_t thread;
+  uint8_t* start;
+  uint8_t* end;
+  uint8_t** buffers;
+  size_t* lengths;
+  size_t* sizes;
+  int started;
+} ColumnChunk;
+
+// A buffer being minified by a pool, for writers that must keep the order of their input
+typedef struct Pending {
+  char* path;
+  uint8_t* data;
+  size_t length; // before minification
+  uint64_t started;
+  ljson_job* job;
+  int fd;                // of a file minified in place
+  size_t relative_start; // of the part of path that --manifest records
+} Pending;
+
+// Files for --bundle are minified by a pool and written in traversal order by the main thread
+typedef struct Bundle {
+  ljson_pool* pool;
+  Pending* entries; // ring of files in flight, oldest first
+  size_t capacity;
+  size_t head;
+  size_t count;
+  int fd;
+  FILE* index;          // "path\toffset\tlength" lines, with \\, \t and \n escaped in the path
+  uint64_t offset;
+  char* temp_path;
+  char* index_path;
+  char* temp_index_path;
+  int failed; // a write failed, so later files are only released and the bundle is discarded
+} Bundle;
+
+// Files minified in place by a pool, then synced, truncated and reported in traversal order by the
+// main thread. Files that need the state of earlier ones, such as --incremental and --schema, and
+// files large enough for non-temporal stores are minified by do_file instead.
+typedef struct Batch {
+  ljson_pool* pool;
+  Pending* entries; // ring of files in flight, oldest first
+  size_t capacity;
+  size_t head;
+  size_t count;
+} Batch;
+
+// A file found by a traversal. The path from relative_start on is what --shard hashes and --manifest
+// records, so that it is the same on every host.
+typedef struct FoundFile {
+  char* path;
+  size_t relative_start;
+  uint64_t readahead; // bytes advised by queue_file
+} FoundFile;
+
+// Files found by the traversal that wait while the ones before them are minified, after their reads
+// were started with posix_fadvise. bytes is the sum of the advised lengths, at most readahead_budget.
+typedef struct Lookahead {
+  FoundFile* files;
+  size_t capacity;
+  size_t head;
+  size_t count;
+  uint64_t bytes;
+} Lookahead;
 
-int do_file(char filename[]);
+// Output of --split-size, rolled over to a new part at the first newline past limit bytes. Standard
+// output is a Split with a limit that is never reached.
+typedef struct Split {
+  int fd;           // current part, or -1 before the first
+  uint64_t written; // bytes in the current part
+  uint64_t limit;
+  size_t part;
+  char* path;       // of the parts; the number is written at number
+  char* number;
+  const char* extension;
+  int failed;
+  unsigned kernels; // chosen for any buffer, as in File
+} Split;
+
+// Buffers of a stream that are queued or being minified, oldest at head. The reading thread adds
+// them and a writing thread removes them in order once they are finished.
+typedef struct Stream {
+  Pending* pending;
+  size_t capacity;
+  size_t head;
+  size_t count;
+  int done; // the reader has queued its last buffer
+  pthread_mutex_t lock;
+  pthread_cond_t changed;
+  Split* split;
+  uint64_t bytes_out;
+} Stream;
+
+// A .idx sidecar is an IndexHeader, then node_count IndexNodes, then entry_count IndexEntries, in
+// native byte order. Nodes are the containers of at least INDEX_SPAN bytes, sorted by start; smaller
+// ones are scanned instead. A node's entries start at first: one per member sorted by key hash, or
+// one per INDEX_STRIDE elements in order.
+typedef struct IndexHeader {
+  char magic[4];        // "LJIX"
+  uint32_t version;
+  uint64_t size;        // of the JSON file when the index was built
+  uint64_t fingerprint; // hash_tail of the JSON file, to notice when it changed
+  uint64_t node_count;
+  uint64_t entry_count;
+} IndexHeader;
+
+typedef struct IndexNode {
+  uint64_t start; // offset of the bracket or brace
+  uint64_t end;   // offset just past the closing one
+  uint64_t first;
+  uint64_t count; // members or elements
+} IndexNode;
+
+typedef struct IndexEntry {
+  uint64_t hash;   // key_hash of the member name; 0 for elements
+  uint64_t offset; // of the member name's opening quote, or of the element
+} IndexEntry;
+
+typedef struct IndexLevel {
+  uint64_t start;
+  uint64_t count;
+  size_t pending; // where this container's entries start in the pending list
+} IndexLevel;
+
+// State of the command-line tool; the library passes options to each call instead
+#ifndef LIGHTERJSON_LIBRARY
+static ljson_options options;
+static int quiet;
+static int build_index;
+static uint64_t shard_index;
+static uint64_t shard_count;
+static char* state_path;
+static char* metrics_path;
+static char* schema_path;
+static char* output_dir;
+static char* bundle_path;
+static char* manifest_path;
+static FILE* manifest;
+static uint64_t split_size;
+static uint64_t readahead_budget = 64 << 20;
+static uint64_t max_request = 64 << 20; // longer --serve requests close the connection unread
+static Bundle bundle;
+static Batch batch;
+static Lookahead lookahead;
+static Column* columns;
+static size_t column_count;
+static Template schema;
+static uint64_t stream_threshold = STREAM_SPAN;
+static volatile sig_atomic_t stop_requested; // by SIGINT or SIGTERM in --serve and --watch
+static Progress* progress_entries; // sorted by path
+static size_t progress_count;
+static size_t progress_size;
+
+static int do_file(char filename[], size_t relative_start);
+static int start_file(char filename[], size_t relative_start);
+static int flush_files(size_t keep);
+static int bundle_file(char filename[]);
+static int write_index(const char path[], uint8_t* data, uint8_t* end);
+static int read_template(Template* template, uint8_t* i, uint8_t* end, int schema);
+static void record_kernel(Kernel kernel);
+#endif
+
+// FNV-1a, for member names and so that every process agrees on the shard of a path without coordination
+static uint64_t hash_bytes(const uint8_t* data, size_t length) {
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  for (size_t i = 0; i < length; ++i) {
+    hash = (hash ^ data[i]) * 0x100000001B3ULL;
+  }
+  return hash;
+}
+
+#ifdef __SSE2__
+// Copies to a lower address with non-temporal stores, so that output which is not read again does not
+// evict other data from the cache. Each block is loaded before it is stored, which makes overlap safe.
+static void stream_move(uint8_t* destination, const uint8_t* source, size_t length) {
+  const uint8_t* end = source + length;
+  __m128i a, b, c, d;
+  for (; ((uintptr_t) destination & 15) && source < end; *destination++ = *source++);
+  for (; source + 64 <= end; source += 64, destination += 64) {
+    _mm_prefetch((const char*) source + STREAM_PREFETCH, _MM_HINT_NTA);
+    a = _mm_loadu_si128((const __m128i*) source);
+    b = _mm_loadu_si128((const __m128i*) (source + 16));
+    c = _mm_loadu_si128((const __m128i*) (source + 32));
+    d = _mm_loadu_si128((const __m128i*) (source + 48));
+    _mm_stream_si128((__m128i*) destination, a);
+    _mm_stream_si128((__m128i*) (destination + 16), b);
+    _mm_stream_si128((__m128i*) (destination + 32), c);
+    _mm_stream_si128((__m128i*) (destination + 48), d);
+  }
+  _mm_sfence();
+  for (; source < end; *destination++ = *source++);
+}
+#endif
 
 // Write queued data and move past data to skip
-void write_data(File* file, ptrdiff_t index_offset) {
-  memmove(file->windex, file->lindex, file->rindex - file->lindex);
+static void write_data(File* file, ptrdiff_t index_offset) {
+  if (file->windex != file->lindex) { // nothing has been removed yet
+#ifdef __SSE2__
+    if (file->stream_span && (size_t) (file->rindex - file->lindex) >= file->stream_span) {
+      stream_move(file->windex, file->lindex, file->rindex - file->lindex);
+    } else
+#endif
+    memmove(file->windex, file->lindex, file->rindex - file->lindex);
+  }
   file->windex += file->rindex - file->lindex;
   file->rindex += index_offset;
   file->lindex = file->rindex;
 }
 
-void do_literal(File* file, const char* literal, size_t length) {
+static void do_literal(File* file, const char* literal, size_t length) {
   if (strncmp((char*) file->rindex, literal, length)) {
-    write_data(file, length);
+    write_data(file, (size_t) (file->data_end - file->rindex) < length ? (size_t) (file->data_end - file->rindex) : length);
   } else {
     file->rindex += length;
   }
 }
 
-uint64_t hex_value(File* file) {
+static uint64_t hex_value(const uint8_t* digits) {
   uint64_t value = 0;
-  if (file->rindex + 4 > file->data_end) {
-    return INT64_MAX;
-  }
-  for (size_t i = 0; i < 4; ++i) {
-    const uint64_t x = file->rindex[i];
+  for (size_t i = 0; i < 4; ++i) { // stops at the NUL at data_end
+    const uint64_t x = digits[i];
     const uint64_t shift = (3 - i) << 2;
     if (x >= '0' && x <= '9') {
       value += ((x - '0') << shift);
@@ -89,8 +382,8 @@ uint64_t hex_value(File* file) {
   return value;
 }
 
-void do_unicode(File* file) {
-  uint64_t value = hex_value(file);
+static void do_unicode(File* file) {
+  uint64_t value = hex_value(file->rindex);
   uint64_t value2 = 0;
   if (value == INT64_MAX) {
     fprintf(stderr, "INVALID HEX\n");
@@ -132,7 +425,7 @@ void do_unicode(File* file) {
     return;
   }
   if (value & 0xD800) { // surrogate pair
-    value2 = hex_value(file);
+    value2 = hex_value(file->rindex);
     if (value2 == INT64_MAX) {
       fprintf(stderr, "INVALID HEX\n");
       return;
@@ -154,398 +447,796 @@ void do_unicode(File* file) {
   }
 }
 
-void do_escape(File* file) {
-  if (file->rindex + 1 < file->data_end) {
-    switch (file->rindex[1]) {
-      case 'u': // unicode
-        write_data(file, 2);
-        do_unicode(file);
+static void do_escape(File* file) {
+  switch (file->rindex[1]) {
+    case 'u': // unicode
+      write_data(file, 2);
+      do_unicode(file);
+      break;
+    case '"':
+    case '\\':
+    case '/':
+    case 'b':
+    case 'f':
+    case 'n':
+    case 'r':
+    case 't':
+      file->rindex += 2;
+      break;
+    case '\0':
+      if (file->rindex + 1 >= file->data_end) {
+        file->rindex = file->data_end; // TODO: error end of file
         break;
-      case '"':
+      }
+      // fall through
+    default:
+      write_data(file, 1);
+      ++(file->rindex);
+  }
+}
+
+static void do_string(File* file) {
+  ++(file->rindex);
+  while (*file->rindex || file->rindex < file->data_end) {
+    switch (*file->rindex) {
       case '\\':
-      case '/':
-      case 'b':
-      case 'f':
-      case 'n':
-      case 'r':
-      case 't':
-        file->rindex += 2;
+        do_escape(file);
         break;
+      case '"':
+        ++(file->rindex);
+        return;
       default:
-        write_data(file, 1);
         ++(file->rindex);
     }
-  } else {
-    // TODO: error end of file
   }
 }
 
-void do_string(File* file) {
+// Returns the first quote, backslash or NUL at or after i. The NUL at data_end ends the search, and
+// the padding after it makes reading whole blocks safe.
+static uint8_t* find_string_special(uint8_t* i) {
+#ifdef __SSE2__
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i backslash = _mm_set1_epi8('\\');
+  const __m128i zero = _mm_setzero_si128();
+  int mask;
+  for (;; i += 16) {
+    const __m128i bytes = _mm_loadu_si128((const __m128i*) i);
+    if ((mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, quote), _mm_cmpeq_epi8(bytes, backslash)),
+                                               _mm_cmpeq_epi8(bytes, zero))))) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#else
+  while (*i && *i != '"' && *i != '\\') {
+    ++i;
+  }
+  return i;
+#endif
+}
+
+// Returns the closing quote of the string whose contents start at i, or end if there is none
+static uint8_t* find_string_end(uint8_t* i, uint8_t* end) {
+  for (;;) {
+    i = find_string_special(i);
+    if (*i == '"') {
+      return i;
+    } else if (i >= end) {
+      return end;
+    }
+    i += *i == '\\' && i + 1 < end ? 2 : 1;
+  }
+}
+
+// do_string for long strings: jumps between quotes and backslashes 16 bytes at a time
+static void do_string_wide(File* file) {
   ++(file->rindex);
-  while (file->rindex < file->data_end) {
+  for (;;) {
+    file->rindex = find_string_special(file->rindex);
     switch (*file->rindex) {
-      case '\\':
-        do_escape(file);
-        break;
       case '"':
         ++(file->rindex);
         return;
-      default:
+      case '\\':
+        do_escape(file);
+        break;
+      default: // NUL
+        if (file->rindex >= file->data_end) {
+          return;
+        }
         ++(file->rindex);
     }
   }
 }
 
-int do_object_label(File* file) {
-  while (file->rindex < file->data_end) {
+// Whether the member names leading to the current level end with one of the comma-separated paths in
+// float32_keys, whose components are separated by dots. Array levels are skipped.
+static int match_key_paths(File* file) {
+  const char* path = file->options->float32_keys;
+  const char* path_end;
+  const char* component;
+  const char* component_end;
+  size_t depth;
+  int matches;
+  while (*path) {
+    path_end = path + strcspn(path, ",");
+    matches = path_end > path;
+    depth = file->key_depth;
+    for (component_end = path_end; matches && component_end > path; component_end = component - 1) {
+      for (component = component_end; component > path && component[-1] != '.'; --component);
+      for (; depth && !file->keys[depth - 1].hash; --depth);
+      matches = depth && file->keys[--depth].hash == hash_bytes((const uint8_t*) component, component_end - component);
+      if (component == path) {
+        break;
+      }
+    }
+    if (matches) {
+      return 1;
+    }
+    path = *path_end ? path_end + 1 : path_end;
+  }
+  return 0;
+}
+
+static void push_key(File* file) {
+  if (file->key_depth == file->key_size) {
+    file->key_size = file->key_size ? file->key_size * 2 : 16;
+    file->keys = realloc(file->keys, file->key_size * sizeof(Key));
+  }
+  file->keys[file->key_depth].hash = 0;
+  file->keys[file->key_depth].float32 = file->key_depth && file->keys[file->key_depth - 1].float32;
+  ++(file->key_depth);
+}
+
+static void pop_key(File* file) {
+  if (file->key_depth) {
+    --(file->key_depth);
+  }
+}
+
+// Records the member name at rindex, using its bytes as written, escapes included. Members nested
+// under a matching one stay selected.
+static void set_key(File* file) {
+  uint8_t* i = find_string_end(file->rindex + 1, file->data_end);
+  Key* key = &file->keys[file->key_depth - 1];
+  key->hash = hash_bytes(file->rindex + 1, i - file->rindex - 1);
+  key->float32 = (file->key_depth > 1 && file->keys[file->key_depth - 2].float32) || match_key_paths(file);
+}
+
+static int float32_applies(File* file) {
+  return file->options->float32 &&
+         (!file->options->float32_keys || (file->key_depth && file->keys[file->key_depth - 1].float32));
+}
+
+static int do_object_label(File* file) {
+  uint8_t* i;
+  while (*file->rindex || file->rindex < file->data_end) {
     switch (*file->rindex) {
       case '"':
+        if (file->options->float32_keys && file->key_depth) {
+          set_key(file);
+        }
         do_string(file);
         return 0;
       case '}':
         return 1;
       default:
-        write_data(file, 1);
+        for (i = file->rindex + 1; *i && *i != '"' && *i != '}'; ++i);
+        write_data(file, i - file->rindex);
     }
   }
   return 1;
 }
 
-void do_object(File* file) {
+static void do_object(File* file) {
   if (do_object_label(file)) {
     return;
   }
-  while (file->rindex < file->data_end) {
-    switch (*file->rindex) {
-      case ':':
-        ++(file->rindex);
-        return;
-      default:
-        write_data(file, 1);
+  uint8_t* i;
+  while (*file->rindex || file->rindex < file->data_end) {
+    if (*file->rindex == ':') {
+      ++(file->rindex);
+      return;
     }
+    for (i = file->rindex + 1; *i && *i != ':'; ++i);
+    write_data(file, i - file->rindex);
+  }
+}
+
+static size_t decimal_width(uint64_t value) {
+  size_t width = 1;
+  while (value >= 10) {
+    value /= 10;
+    ++width;
   }
+  return width;
 }
 
-void do_number(File* file) {
-  uint8_t* decimal = 0;
-  uint8_t* exponent = 0;
-  uint8_t* non_zero_start = 0;
-  uint8_t* non_zero_finish = 0;
-  uint8_t* exponent_start = 0;
-  uint8_t* number_end = 0;
-  int64_t exponent_value = 0;
-  int64_t min_exponent = 0;
-  int64_t max_exponent = 0;
-  int64_t new_decimal = 0;
-  int64_t new_exponent = 0;
-  uint64_t digit_width = 0;
-  uint64_t new_exponent_width = 0;
+// Rewrites the number at rindex in its shortest form: no sign on zero, no leading or trailing zeros,
+// and an exponent only when that is shorter. Digits past precision decimal places are rounded half up.
+static void do_number(File* file) {
+  const int64_t precision = file->options->precision;
+  uint8_t local[256];
+  uint8_t* buffer = local;
+  uint8_t* digits;
+  uint8_t* output;
+  uint8_t* i = file->rindex;
+  uint8_t* integer_start;
+  uint8_t* integer_end;
+  uint8_t* fraction_start;
+  uint8_t* fraction_end;
+  uint8_t exponent_char = 'E';
   int negative = 0;
   int negative_exponent = 0;
-  uint64_t zeroes = 0;
-  uint8_t* i;
-  uint64_t multiplier = 1;
-  if (*file->rindex == '-') {
+  int64_t exponent = 0;
+  int64_t drop;
+  size_t digit_count;
+  size_t first = 0;
+  size_t count;
+  size_t output_length = 0;
+  size_t zeroes;
+  size_t j;
+  if (*i == '-') {
     negative = 1;
-    ++(file->rindex);
+    ++i;
   }
-  for (i = file->rindex; i < file->data_end && !exponent && !number_end; ++i) {
-    switch (*i) {
-      case '.':
-        decimal = i;
-        break;      
-      case 'e':
-      case 'E':
-        exponent = i;
-        if (i + 1 < file->data_end) {
-          switch (*(i + 1)) {
-            case '-':
-              negative_exponent = 1;
-              // fallthrough
-            case '+':
-              ++i;
-          }
-        }
-        break;
-      case '0':
-        break;
-      case '1':
-      case '2':
-      case '3':
-      case '4':
-      case '5':
-      case '6':
-      case '7':
-      case '8':
-      case '9':
-        if (!non_zero_start) {
-          non_zero_start = i;
-        }
-        non_zero_finish = i;
-        break;
-      default:
-        number_end = i - 1;
-    }
+  for (integer_start = i; *i >= '0' && *i <= '9'; ++i);
+  integer_end = i;
+  if (*i == '.') {
+    ++i;
   }
-  if (!number_end) {
-    for (; i < file->data_end && !number_end; ++i) {
-      switch (*i) {
-        case '0':
-          break;
-        case '1':
-        case '2':
-        case '3':
-        case '4':
-        case '5':
-        case '6':
-        case '7':
-        case '8':
-        case '9':
-          if (!exponent_start) {
-            exponent_start = i;
-          }
-          break;
-        default:
-          number_end = i - 1;
+  for (fraction_start = i; *i >= '0' && *i <= '9'; ++i);
+  fraction_end = i;
+  if ((*i == 'e' || *i == 'E')) {
+    exponent_char = *i++;
+    if ((*i == '+' || *i == '-')) {
+      negative_exponent = *i++ == '-';
+    }
+    for (; *i >= '0' && *i <= '9'; ++i) {
+      if (exponent > (INT64_MAX / 4 - 9) / 10) {
+        for (; *i >= '0' && *i <= '9'; ++i);
+        file->rindex = i; // exponents this large are copied unchanged
+        return;
       }
+      exponent = exponent * 10 + (*i - '0');
     }
+    if (negative_exponent) {
+      exponent = -exponent;
+    }
+  }
+  digit_count = (integer_end - integer_start) + (fraction_end - fraction_start);
+  if (!digit_count) {
+    write_data(file, i - file->rindex); // a sign or exponent without digits
+    return;
+  }
+  if (digit_count * 2 + 64 > sizeof(local) && !(buffer = malloc(digit_count * 2 + 64))) {
+    file->rindex = i;
+    return;
+  }
+  digits = buffer;
+  output = buffer + digit_count;
+  memcpy(digits, integer_start, integer_end - integer_start);
+  memcpy(digits + (integer_end - integer_start), fraction_start, fraction_end - fraction_start);
+  while (first < digit_count && digits[first] == '0') {
+    ++first;
   }
-  if (!number_end) {
-    number_end = file->data_end - 1;
+  // The value is digits[first, first + count) * 10^exponent
+  for (count = digit_count - first; count && digits[first + count - 1] == '0'; --count);
+  exponent += (int64_t) (integer_end - integer_start) - (int64_t) (first + count);
+  if (count && precision != INT64_MAX && exponent < -precision) {
+    if (__builtin_sub_overflow(-precision, exponent, &drop) || (uint64_t) drop > count || ((uint64_t) drop == count && digits[first] < '5')) {
+      count = 0;
+    } else if ((uint64_t) drop == count) {
+      digits[first] = '1';
+      count = 1;
+      exponent = -precision;
+    } else {
+      count -= drop;
+      exponent = -precision;
+      if (digits[first + count] >= '5') {
+        for (j = count; j && digits[first + j - 1] == '9'; --j) {
+          digits[first + j - 1] = '0';
+        }
+        if (j) {
+          ++digits[first + j - 1];
+        } else {
+          digits[first] = '1';
+          exponent += count;
+          count = 1;
+        }
+      }
+      for (; digits[first + count - 1] == '0'; --count, ++exponent);
+    }
   }
-  if (!non_zero_start) {
+  if (!count) {
+    output[output_length++] = '0';
+  } else {
     if (negative) {
-      --(file->rindex);
+      output[output_length++] = '-';
     }
-    if (number_end == file->rindex) {
-      ++(file->rindex);
+    if (exponent >= 0 && (uint64_t) exponent <= 1 + decimal_width(exponent)) {
+      memcpy(output + output_length, digits + first, count);
+      output_length += count;
+      memset(output + output_length, '0', exponent);
+      output_length += exponent;
+    } else if (exponent < 0 && (uint64_t) -exponent < count) {
+      memcpy(output + output_length, digits + first, count + exponent);
+      output_length += count + exponent;
+      output[output_length++] = '.';
+      memcpy(output + output_length, digits + first + count + exponent, -exponent);
+      output_length -= exponent;
+    } else if (exponent < 0 && (uint64_t) -exponent <= count + decimal_width(-exponent)) {
+      zeroes = -exponent - count;
+      output[output_length++] = '0';
+      output[output_length++] = '.';
+      memset(output + output_length, '0', zeroes);
+      output_length += zeroes;
+      memcpy(output + output_length, digits + first, count);
+      output_length += count;
     } else {
-      write_data(file, number_end - file->rindex);
-      *file->windex++ = '0';
+      memcpy(output + output_length, digits + first, count);
+      output_length += count;
+      output_length += sprintf((char*) output + output_length, "%c%" PRId64, exponent_char, exponent);
     }
-    return;
   }
-  if (!exponent_start) {
-    exponent_start = number_end;
+  if (output_length == (size_t) (i - file->rindex) && memcmp(output, file->rindex, output_length) == 0) {
+    file->rindex = i;
+  } else if (output_length <= (size_t) (i - file->rindex)) {
+    write_data(file, i - file->rindex);
+    memcpy(file->windex, output, output_length);
+    file->windex += output_length;
+  } else {
+    file->rindex = i;
+  }
+  if (buffer != local) {
+    free(buffer);
+  }
+}
+
+// Exact powers of ten in long double, enough for the float32 range in two steps
+static const long double exact_powers[] = {1e0L, 1e1L, 1e2L, 1e3L, 1e4L, 1e5L, 1e6L, 1e7L, 1e8L, 1e9L, 1e10L, 1e11L, 1e12L, 1e13L, 1e14L, 1e15L, 1e16L, 1e17L, 1e18L, 1e19L, 1e20L, 1e21L, 1e22L, 1e23L, 1e24L, 1e25L, 1e26L, 1e27L};
+
+static long double scale10(long double value, int exponent) {
+  for (; exponent > 27; exponent -= 27) {
+    value *= exact_powers[27];
+  }
+  for (; exponent < -27; exponent += 27) {
+    value /= exact_powers[27];
   }
-  if (exponent) {
-    for (i = number_end; i >= exponent_start; --i) {
-      exponent_value += (*i - '0') * multiplier;
-      multiplier *= 10;
+  return exponent >= 0 ? value * exact_powers[exponent] : value / exact_powers[-exponent];
+}
+
+// The halfway points between the positive normal float with these bits and its neighbours
+static void float32_bounds(uint32_t bits, long double* low, long double* high) {
+  const int64_t mantissa = (bits & 0x7FFFFF) | 0x800000;
+  const long double unit = ldexpl(1, (int) ((bits >> 23) & 0xFF) - 150);
+  *high = (mantissa + 0.5L) * unit;
+  *low = (mantissa - (mantissa == 0x800000 ? 0.25L : 0.5L)) * unit; // neighbours are closer below a power of two
+}
+
+// Whether x, which approximates a decimal to about 60 bits, lies between low and high. Points too
+// close to either to decide count as outside. Exact halfway points round to an even mantissa.
+static int within_float32(long double x, long double low, long double high, uint32_t bits, int exact) {
+  const long double margin = x * LDBL_EPSILON * 16;
+  return (x - low > margin || (exact && x == low && !(bits & 1))) && (high - x > margin || (exact && x == high && !(bits & 1)));
+}
+
+// Parses a positive number with the first 19 significant digits in long double. Returns 0 when the
+// result is not a normal float or is too close to a rounding boundary, so strtof has to decide.
+static int parse_float32(const uint8_t* i, const uint8_t* end, float* value) {
+  uint64_t mantissa = 0;
+  int64_t exponent = 0;
+  int64_t written_exponent = 0;
+  int digits = 0;
+  int negative_exponent = 0;
+  uint32_t bits;
+  long double x;
+  long double low;
+  long double high;
+  for (; i < end && *i >= '0' && *i <= '9'; ++i) {
+    if (digits < 19) {
+      mantissa = mantissa * 10 + (*i - '0');
+      digits += mantissa != 0;
+    } else {
+      ++exponent;
     }
   }
-  if (negative_exponent) {
-    exponent_value *= -1;
+  if (i < end && *i == '.') {
+    for (++i; i < end && *i >= '0' && *i <= '9'; ++i) {
+      if (digits < 19) {
+        mantissa = mantissa * 10 + (*i - '0');
+        digits += mantissa != 0;
+        --exponent;
+      }
+    }
+  }
+  if (i < end && (*i == 'e' || *i == 'E')) {
+    ++i;
+    if (i < end && (*i == '+' || *i == '-')) {
+      negative_exponent = *i++ == '-';
+    }
+    for (; i < end && *i >= '0' && *i <= '9' && written_exponent < 100000; ++i) {
+      written_exponent = written_exponent * 10 + (*i - '0');
+    }
+    exponent += negative_exponent ? -written_exponent : written_exponent;
+  }
+  if (!mantissa || exponent < -80 || exponent > 60) {
+    return 0;
   }
-  max_exponent = (int64_t)(decimal ? decimal > non_zero_start ? decimal - 1 : decimal : exponent ? exponent - 1 : number_end) - (int64_t)non_zero_start + exponent_value;
-  min_exponent = (int64_t)(decimal ? decimal > non_zero_finish ? decimal - 1 : decimal : exponent ? exponent - 1 : number_end) - (int64_t)non_zero_finish + exponent_value;
+  x = scale10(mantissa, exponent);
+  *value = x;
+  memcpy(&bits, value, sizeof(bits));
+  if (((bits >> 23) & 0xFF) == 0 || ((bits >> 23) & 0xFF) == 0xFF) {
+    return 0;
+  }
+  float32_bounds(bits, &low, &high);
+  return within_float32(x, low, high, bits, 0);
+}
 
-  // Rounding
-  if (-precision > max_exponent) {
-    if (negative) {
-      --(file->rindex);
+// Writes the shortest digits and exponent that read back as the positive normal float with these bits
+static size_t shortest_float32(uint32_t bits, char text[]) {
+  const long double exact = ldexpl((bits & 0x7FFFFF) | 0x800000, (int) ((bits >> 23) & 0xFF) - 150);
+  const int decimal_exponent = ((((int) (bits >> 23) & 0xFF) - 127) * 1233) >> 12; // log10, or one less
+  int64_t best_mantissa = 0;
+  int best_exponent = 0;
+  int fewest = 1;
+  int most = 10; // nine digits always round-trip, but the exponent estimate can be one low
+  size_t length = 0;
+  char reversed[24];
+  long double low;
+  long double high;
+  float32_bounds(bits, &low, &high);
+  // A candidate that round-trips stays valid with more digits, so search for the fewest
+  while (fewest < most) {
+    const int digits = (fewest + most) / 2;
+    const int exponent = decimal_exponent - digits + 1;
+    const int64_t mantissa = llroundl(scale10(exact, -exponent));
+    if (within_float32(scale10(mantissa, exponent), low, high, bits, 1)) {
+      most = digits;
+      best_mantissa = mantissa;
+      best_exponent = exponent;
+    } else {
+      fewest = digits + 1;
     }
-    write_data(file, number_end - file->rindex);
-    *file->windex++ = '0';
-    return;
   }
-  if (-precision > min_exponent) {
-    min_exponent = -precision;
-    // find offset
-    i = (decimal ? decimal > file->rindex + precision ? decimal - 1 : decimal : exponent ? exponent - 1 : number_end) + precision + exponent_value;
-    if (i < non_zero_finish) {
-      if ( *(i + 1) >= '5') {
-        for (; i >= non_zero_start; --i) {
-          if (*i == '9') {
-            ++min_exponent;
-          } else if (*i != '.') {
-            ++*i;
-            break;
-          }
-        }
-        // if first position incremented
-        if (i < non_zero_start) {
-          *(++i) = '1';
-          ++max_exponent;
-        }
+  if (most == 10) {
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    return sprintf(text, "%.8e", value);
+  }
+  do {
+    reversed[length++] = '0' + best_mantissa % 10;
+  } while (best_mantissa /= 10);
+  // Plain notation when the point falls inside or just before the digits, as do_number would choose
+  if (best_exponent < 0 && (size_t) -best_exponent <= length + 1) {
+    const size_t point = (size_t) -best_exponent < length ? length + best_exponent : 0;
+    size_t j = 0;
+    if (!point) {
+      text[j++] = '0';
+      text[j++] = '.';
+      if ((size_t) -best_exponent > length) {
+        text[j++] = '0';
       }
-      while (i >= non_zero_start && *i == '0') {
-        --i;
-        ++min_exponent;
+    }
+    for (size_t k = 0; k < length; ++k) {
+      if (point && k == point) {
+        text[j++] = '.';
       }
+      text[j++] = reversed[length - 1 - k];
     }
-    non_zero_finish = i;
+    return j;
   }
+  for (size_t j = 0; j < length; ++j) {
+    text[j] = reversed[length - 1 - j];
+  }
+  if (!best_exponent) {
+    return length;
+  }
+  text[length++] = 'e';
+  if (best_exponent < 0) {
+    text[length++] = '-';
+    best_exponent = -best_exponent;
+  }
+  if (best_exponent >= 10) { // at most two digits in the float32 range
+    text[length++] = '0' + best_exponent / 10;
+  }
+  text[length++] = '0' + best_exponent % 10;
+  return length;
+}
 
-  digit_width = max_exponent - min_exponent + 1;
-  if (min_exponent > 0) {
-    zeroes = min_exponent;
-  } else if (max_exponent < 0) {
-    zeroes = -max_exponent;
+// Replaces a non-integer number by the shortest decimal that reads back as the same float32, then
+// lets do_number bring it into shortest form. Values that are not normal floats are left alone, since
+// -Ofast flushes subnormals to zero and assumes there are no infinities.
+static void do_float32(File* file) {
+  char text[64];
+  char shortest[32];
+  uint8_t* i = file->rindex;
+  const int negative = *i == '-';
+  size_t length;
+  size_t shortest_length;
+  int integer = 1;
+  uint32_t bits;
+  float value;
+  for (; ((*i >= '0' && *i <= '9') || *i == '-' || *i == '+' || *i == '.' || *i == 'e' || *i == 'E'); ++i) {
+    integer &= *i != '.' && *i != 'e' && *i != 'E';
   }
-  if (zeroes < 3) {
-    if (min_exponent < 0) {
-      new_decimal = max_exponent >= 0 ? max_exponent + 1 : 1;
-    }
-  } else {
-    new_exponent = min_exponent;
-    zeroes = 0;
-  }
-  if (non_zero_start > file->rindex) {
-    write_data(file, non_zero_start - file->rindex);
-  }
-  if (decimal == file->rindex + new_decimal && exponent_value == new_exponent) {
-    file->rindex += zeroes + digit_width + 1;
-  }
-  else if (zeroes && max_exponent < 0) {
-    i = file->windex;
-    file->windex += zeroes + 1;
-    if (non_zero_start < decimal && non_zero_finish > decimal) {
-      write_data(file, decimal - non_zero_start + 1);
-      file->rindex = non_zero_finish + 1;
-      file->windex += decimal - non_zero_start;
-      write_data(file, -digit_width - 1);
-      file->rindex = decimal;
-      file->windex = i + zeroes + 1;
-      write_data(file, non_zero_finish - decimal);
-      file->windex += non_zero_finish - decimal;
-    } else {
-      file->rindex = non_zero_finish + 1;
+  length = i - file->rindex;
+  if (integer || length >= sizeof(text)) {
+    do_number(file);
+    return;
+  }
+  if (!parse_float32(file->rindex + negative, i, &value)) {
+    memcpy(text, file->rindex + negative, length - negative);
+    text[length - negative] = '\0';
+    value = strtof(text, NULL);
+  }
+  memcpy(&bits, &value, sizeof(bits));
+  if (((bits >> 23) & 0xFF) == 0 || ((bits >> 23) & 0xFF) == 0xFF) {
+    do_number(file);
+    return;
+  }
+  shortest[0] = '-';
+  shortest_length = negative + shortest_float32(bits, shortest + negative);
+  if (shortest_length <= length) {
+    // Put it at the end of the original span and skip the rest
+    memcpy(i - shortest_length, shortest, shortest_length);
+    write_data(file, length - shortest_length);
+  }
+  do_number(file);
+}
+
+// Handles numbers without an exponent in place, including rounding that does not carry into another
+// digit, when they are nonzero and would not be shorter with an exponent. Everything else goes to
+// do_number.
+static void do_decimal(File* file) {
+  const int64_t precision = file->options->precision;
+  uint8_t* i = file->rindex + (*file->rindex == '-');
+  uint8_t* zeroes; // end of the last nonzero integer digit
+  uint8_t* nonzero;
+  uint8_t* point;
+  uint8_t* end;    // end of the kept digits
+  uint8_t* last = NULL;
+  if (precision < 0) {
+    do_number(file);
+    return;
+  }
+  if (*i == '0') {
+    // 0.x and 0.0x keep their form as long as that digit survives rounding
+    nonzero = i + 2 + (i[1] == '.' && i[2] == '0');
+    if (i[1] != '.' || *nonzero < '1' || *nonzero > '9' ||
+        (uint64_t) (nonzero - i - 2) >= (uint64_t) precision) {
+      do_number(file);
+      return;
     }
-    write_data(file, 0);
-    *i++ = '0';
-    *i++ = '.';
-    if (zeroes > 1) {
-      *i = '0';
+    zeroes = ++i;
+  } else if (*i >= '1' && *i <= '9') {
+    for (zeroes = ++i; *i >= '0' && *i <= '9'; ++i) {
+      if (*i != '0') {
+        zeroes = i + 1;
+      }
     }
   } else {
-    if (decimal) {
-      if ((!new_decimal && non_zero_start < decimal && non_zero_finish > decimal) || (new_decimal && non_zero_start + new_decimal > decimal)) {
-        file->rindex = decimal;
-        write_data(file, 1);
-      } else if (new_decimal && decimal && non_zero_start + new_decimal < decimal) {
-        file->rindex = non_zero_start + new_decimal;
-        write_data(file, 0);
-        i = file->windex++;
-        file->rindex = decimal;
-        write_data(file, 1);
-        *i = '.';
-      }
-    }
-    if (new_decimal && (!decimal || non_zero_start + new_decimal > decimal)) {
-      file->rindex = non_zero_start + new_decimal + (decimal ? 1 : 0);
-      write_data(file, 0);
-      i = file->windex++;
-      file->rindex = non_zero_finish + 1;
-      write_data(file, 0);
-      *i = '.';
-    } else {
-      file->rindex = non_zero_finish + 1;
-    }
-    if (zeroes) {
-      if (non_zero_finish + 1 + zeroes == (exponent ? exponent : number_end)) {
-        file->rindex += zeroes;
-      } else {
-        write_data(file, 0);
-        *file->windex++ = '0';
-        if (zeroes > 1) {
-          *file->windex++ = '0';
-        }
+    do_number(file);
+    return;
+  }
+  point = i;
+  if (*i == '.') {
+    for (++i; *i >= '0' && *i <= '9'; ++i);
+  }
+  if (*i == 'e' || *i == 'E') {
+    do_number(file);
+    return;
+  }
+  end = i;
+  if (point < i && (uint64_t) (i - point - 1) > (uint64_t) precision) {
+    end = point + 1 + precision;
+    if (*end >= '5') {
+      last = precision ? end - 1 : point - 1;
+      if (*last == '9') {
+        do_number(file);
+        return;
       }
     }
   }
-  if (exponent > file->rindex) {
-    write_data(file, exponent - file->rindex);
+  if (last) {
+    end = precision ? end : point;
+  } else if (point < end) {
+    for (; end > point + 1 && end[-1] == '0'; --end);
+    end = end == point + 1 ? point : end;
   }
-  if (new_exponent) {
-    for (int64_t x = 1; new_exponent / x; x *= 10) {
-      ++new_exponent_width;
-    }
-    if (exponent_value == new_exponent && number_end - exponent == new_exponent_width + negative_exponent) {
-      file->rindex += new_exponent_width + negative_exponent + 1;
-    } else {
-      write_data(file, exponent_start ? exponent_start - file->rindex : 0);
-      *file->windex++ = 'E';
-      if (new_exponent < 0) {
-        *file->windex++ = '-';
-      }
-      if (new_exponent == exponent_value) {
-        file->rindex += new_exponent_width;
-      } else {
-        file->windex += new_exponent_width - 1;
-        if (new_exponent < 0) {
-          new_exponent = -new_exponent;
+  if (end == point && !last && point - zeroes >= 3) {
+    do_number(file); // shorter with an exponent
+    return;
+  }
+  if (last) {
+    ++*last;
+  }
+  file->rindex = end;
+  if (end < i) {
+    write_data(file, i - end);
+  }
+}
+
+// Tight loop for arrays of numbers, such as coordinates and feature vectors. Stops at the first byte
+// that is not part of a number, a comma or whitespace, and returns the new comma_ok.
+static int do_number_array(File* file, int comma_ok) {
+  uint8_t* i;
+  while (*file->rindex || file->rindex < file->data_end) {
+    switch (*file->rindex) {
+      case ' ':
+      case '\t':
+      case '\n':
+      case '\r':
+        for (i = file->rindex + 1; *i == ' ' || *i == '\t' || *i == '\n' || *i == '\r'; ++i);
+        write_data(file, i - file->rindex);
+        break;
+      case ',':
+        if (comma_ok) {
+          ++(file->rindex);
+        } else {
+          write_data(file, 1);
         }
-        while (new_exponent) {
-          *file->windex-- = new_exponent % 10 + '0';
-          new_exponent /= 10;
+        break;
+      case '-':
+      case '0':
+      case '1':
+      case '2':
+      case '3':
+      case '4':
+      case '5':
+      case '6':
+      case '7':
+      case '8':
+      case '9':
+        if (float32_applies(file)) {
+          do_float32(file);
+        } else {
+          do_decimal(file);
         }
-        file->windex += new_exponent_width + 1;
+        comma_ok = 1;
+        break;
+      default:
+        return comma_ok;
+    }
+  }
+  return comma_ok;
+}
+
+// Classifies the next KERNEL_SAMPLE bytes. A sample starting inside a string sees strings inverted,
+// which the next sample corrects.
+static void choose_kernel(File* file) {
+  uint8_t* end = file->data_end - file->rindex > KERNEL_SAMPLE ? file->rindex + KERNEL_SAMPLE : file->data_end;
+  size_t strings = 0;
+  size_t spaces = 0;
+  size_t digits = 0;
+  int in_string = 0;
+  for (uint8_t* i = file->rindex; i < end; ++i) {
+    if (in_string) {
+      ++strings;
+      if (*i == '\\') {
+        ++i;
+        ++strings;
+      } else if (*i == '"') {
+        in_string = 0;
       }
+    } else if (*i == '"') {
+      in_string = 1;
+      ++strings;
+    } else if (*i == ' ' || *i == '\t' || *i == '\n' || *i == '\r') {
+      ++spaces;
+    } else if (*i >= '0' && *i <= '9') {
+      ++digits;
     }
   }
-  if (number_end > file->rindex) {
-    write_data(file, number_end - file->rindex);
+  const size_t size = end - file->rindex;
+  if (spaces * 200 < size) {
+    file->kernel = Compact;
+  } else if (strings * 2 > size) {
+    file->kernel = Strings;
+  } else if (digits * 4 > size) {
+    file->kernel = Numbers;
+  } else {
+    file->kernel = Generic;
   }
+  file->kernels |= 1u << file->kernel;
+  file->next_sample = file->rindex - file->data_start + KERNEL_INTERVAL;
+#ifndef LIGHTERJSON_LIBRARY
+  record_kernel(file->kernel);
+#endif
 }
 
-void init_bits(Bitfield* bitfield) {
-  bitfield->size = sizeof(uint64_t);
-  bitfield->bits = (uint64_t*) malloc(bitfield->size);
-  bitfield->bit_level = 0;
-  bitfield->byte_level = 0;
+static void init_bits(Bitfield* bitfield) {
+  bitfield->size = 1;
+  bitfield->local = 0;
+  bitfield->bits = &bitfield->local;
+  bitfield->depth = 0;
   bitfield->current = -1;
 }
 
-void increment_bit(Bitfield* bitfield) {
-  if (bitfield->bit_level == sizeof(uint64_t) * CHAR_BIT - 1) {
-    bitfield->bit_level = 0;
-    ++(bitfield->byte_level);
-  } else {
-    ++(bitfield->bit_level);
+static void free_bits(Bitfield* bitfield) {
+  if (bitfield->bits != &bitfield->local) {
+    free(bitfield->bits);
   }
-  if (bitfield->byte_level > bitfield->size) {
-    bitfield->bits = realloc(bitfield->bits, ++(bitfield->size));
+}
+
+// Doubles the words when full, so that deep nesting costs amortized constant time per level
+static void push_bit(Bitfield* bitfield, uint64_t bit) {
+  const size_t word = bitfield->depth / 64;
+  if (word == bitfield->size) {
+    bitfield->size *= 2;
+    if (bitfield->bits == &bitfield->local) {
+      bitfield->bits = malloc(bitfield->size * sizeof(uint64_t));
+      bitfield->bits[0] = bitfield->local;
+    } else {
+      bitfield->bits = realloc(bitfield->bits, bitfield->size * sizeof(uint64_t));
+    }
   }
+  bitfield->bits[word] = (bitfield->bits[word] & ~(1ULL << bitfield->depth % 64)) | bit << bitfield->depth % 64;
+  bitfield->current = bit;
+  ++(bitfield->depth);
 }
 
-void push_set_bit(Bitfield* bitfield) {
-  bitfield->current = 1;
-  bitfield->bits[bitfield->byte_level] |= (1ULL << bitfield->bit_level);
-  increment_bit(bitfield);
+static void push_set_bit(Bitfield* bitfield) {
+  push_bit(bitfield, 1);
 }
 
-void push_clear_bit(Bitfield* bitfield) {
-  bitfield->current = 0;
-  bitfield->bits[bitfield->byte_level] &= ~(1ULL << bitfield->bit_level);
-  increment_bit(bitfield);
+static void push_clear_bit(Bitfield* bitfield) {
+  push_bit(bitfield, 0);
 }
 
-void pop_bit(Bitfield* bitfield) {
-  if (bitfield->bit_level == 0) {
-    if (bitfield->byte_level > 0) {
-      --(bitfield->byte_level);
-      bitfield->bit_level = sizeof(uint64_t) * CHAR_BIT - 1;
-    }
+static void pop_bit(Bitfield* bitfield) {
+  if (bitfield->depth) {
+    --(bitfield->depth);
+  }
+  bitfield->current = bitfield->depth ? (bitfield->bits[(bitfield->depth - 1) / 64] >> (bitfield->depth - 1) % 64) & 1 : (size_t) -1;
+}
+
+// Bytes that do_value does not drop on sight, and the NUL that may end the range
+static const uint8_t token_start[256] = {
+  ['\0'] = 1, ['"'] = 1, ['{'] = 1, ['}'] = 1, ['['] = 1, [']'] = 1, [','] = 1, ['t'] = 1, ['f'] = 1, ['n'] = 1,
+  ['-'] = 1, ['0'] = 1, ['1'] = 1, ['2'] = 1, ['3'] = 1, ['4'] = 1, ['5'] = 1, ['6'] = 1, ['7'] = 1, ['8'] = 1, ['9'] = 1
+};
+
+static void do_number_value(File* file) {
+  if (float32_applies(file)) {
+    do_float32(file);
+  } else if (file->kernel & Numbers) {
+    do_decimal(file);
   } else {
-    --(bitfield->bit_level);
+    do_number(file);
   }
-  bitfield->current = bitfield->bit_level > 0 || bitfield->byte_level > 0 ? (bitfield->bits[bitfield->byte_level] >> (bitfield->bit_level - 1)) & 1 : -1;
 }
 
-int do_value(File* file, int line_start) {
+// Minifies until data_end. A call resumed inside a top-level object (container Object) starts with
+// that object open and comma_ok as the caller left it. With single, returns as soon as one value at
+// the starting level is complete.
+static int do_values(File* file, Container container, int comma_ok, int single) {
+  uint8_t* i;
   Bitfield parent_types;
+  const int track_keys = file->options->float32_keys != NULL;
   init_bits(&parent_types);
-  int comma_ok = 0;
-  while (file->rindex < file->data_end) {
+  if (container == Object) {
+    push_set_bit(&parent_types);
+  }
+  const size_t base = parent_types.depth;
+  while (*file->rindex || file->rindex < file->data_end) {
+    if ((size_t) (file->rindex - file->data_start) >= file->next_sample) {
+      choose_kernel(file);
+    }
     switch (*file->rindex) {
       case '"':
-        do_string(file);
+        if (file->kernel & Strings) {
+          do_string_wide(file);
+        } else {
+          do_string(file);
+        }
         comma_ok = 1;
         break;
       case '{':
         ++(file->rindex);
         push_set_bit(&parent_types);
+        if (track_keys) {
+          push_key(file);
+        }
         do_object(file);
         comma_ok = 0;
         break;
@@ -553,6 +1244,9 @@ int do_value(File* file, int line_start) {
         if (parent_types.current == Object) {
           ++(file->rindex);
           pop_bit(&parent_types);
+          if (track_keys) {
+            pop_key(file);
+          }
           comma_ok = 1;
         } else {
           write_data(file, 1);
@@ -561,180 +1255,3520 @@ int do_value(File* file, int line_start) {
       case '[':
         ++(file->rindex);
         push_clear_bit(&parent_types);
-        comma_ok = 0;
+        if (track_keys) {
+          push_key(file);
+        }
+        comma_ok = do_number_array(file, 0);
         break;
       case ']':
         if (parent_types.current == Array) {
           ++(file->rindex);
           pop_bit(&parent_types);
+          if (track_keys) {
+            pop_key(file);
+          }
           comma_ok = 1;
         } else {
           write_data(file, 1);
         }
         break;
-      case ',':
-        if (comma_ok && parent_types.current != None) {
-          ++(file->rindex);
-          if (parent_types.current == Object) {
-            do_object(file);
-          }
-        } else {
-          write_data(file, 1);
+      case ',':
+        if (comma_ok && parent_types.current != None) {
+          ++(file->rindex);
+          if (parent_types.current == Object) {
+            do_object(file);
+          }
+        } else {
+          write_data(file, 1);
+        }
+        break;
+      case 't':
+        do_literal(file, "true", 4);
+        comma_ok = 1;
+        break;
+      case 'f':
+        do_literal(file, "false", 5);
+        comma_ok = 1;
+        break;
+      case 'n':
+        do_literal(file, "null", 4);
+        comma_ok = 1;
+        break;
+      case '-':
+      case '0':
+      case '1':
+      case '2':
+      case '3':
+      case '4':
+      case '5':
+      case '6':
+      case '7':
+      case '8':
+      case '9':
+        do_number_value(file);
+        comma_ok = 1;
+        break;
+      default: // invalid or whitespace, dropped as one run
+        for (i = file->rindex + 1; !token_start[*i]; ++i);
+        write_data(file, i - file->rindex);
+    }
+    if (single && comma_ok && parent_types.depth == base) {
+      break;
+    }
+  }
+  free_bits(&parent_types);
+  if (!single) {
+    free(file->keys);
+    file->keys = NULL;
+    file->key_depth = file->key_size = 0;
+  }
+  return 0;
+}
+
+static int do_value(File* file) {
+  return do_values(file, None, 0, 0);
+}
+
+#ifndef LIGHTERJSON_LIBRARY
+// Templates are only used by --schema
+static uint8_t* skip_space(uint8_t* i) {
+  while (*i == ' ' || *i == '\t' || *i == '\n' || *i == '\r') {
+    ++i;
+  }
+  return i;
+}
+
+static void drop_space(File* file) {
+  uint8_t* i = skip_space(file->rindex);
+  if (i > file->rindex) {
+    write_data(file, i - file->rindex);
+  }
+}
+
+// Compares length bytes 16 at a time, reading up to 15 bytes past them on both sides
+static int equal_bytes(const uint8_t* a, const uint8_t* b, size_t length) {
+#ifdef __SSE2__
+  int mask;
+  for (; length >= 16; a += 16, b += 16, length -= 16) {
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) a), _mm_loadu_si128((const __m128i*) b))) != 0xFFFF) {
+      return 0;
+    }
+  }
+  mask = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*) a), _mm_loadu_si128((const __m128i*) b)));
+  return (~mask & ((1 << length) - 1)) == 0;
+#else
+  return !memcmp(a, b, length);
+#endif
+}
+
+// Replaces length bytes at rindex with their minified form, which is never longer
+static void write_layout(File* file, size_t length, const uint8_t* minified, size_t minified_length) {
+  if (length == minified_length) { // no whitespace, so the bytes are already minified
+    file->rindex += length;
+  } else {
+    write_data(file, length);
+    memcpy(file->windex, minified, minified_length);
+    file->windex += minified_length;
+  }
+}
+
+// Minifies a line expected to hold an object with the template's members in order. Where the bytes
+// between two values are as learned, they are compared 16 at a time and replaced with their minified
+// form; otherwise the name is compared whole. Values go straight to the kernel for the expected kind.
+// At the first difference, do_values carries on from the same state, so the output is as without a
+// template. Returns whether the whole line matched.
+static int do_record(File* file, const Template* template) {
+  const uint8_t* bytes = template->bytes;
+  const Field* field;
+  uint8_t* i;
+  int matched;
+  // comma_ok as do_values has it: set by the first value and kept after later commas
+  for (field = template->fields; field < template->fields + template->count; ++field) {
+    if (field->layout_length && (size_t) (file->data_end - file->rindex) >= field->layout_length &&
+        equal_bytes(file->rindex, bytes + field->layout, field->layout_length)) {
+      write_layout(file, field->layout_length, bytes + field->minified, field->minified_length);
+    } else {
+      drop_space(file);
+      if (field == template->fields) {
+        if (*file->rindex != '{') {
+          do_value(file);
+          return 0;
+        }
+      } else if (*file->rindex != ',') {
+        do_values(file, Object, 1, 0);
+        return 0;
+      }
+      ++(file->rindex);
+      drop_space(file);
+      if ((size_t) (file->data_end - file->rindex) < field->length || !equal_bytes(file->rindex, bytes + field->name, field->length) ||
+          *(i = skip_space(file->rindex + field->length)) != ':') {
+        do_object(file);
+        do_values(file, Object, field > template->fields, 0);
+        return 0;
+      }
+      if (field->escaped) {
+        do_string(file);
+      } else {
+        file->rindex += field->length;
+      }
+      if (i > file->rindex) {
+        write_data(file, i - file->rindex);
+      }
+      ++(file->rindex);
+      drop_space(file);
+    }
+    if (field->kind == StringValue && *file->rindex == '"') {
+      if (file->kernel & Strings) {
+        do_string_wide(file);
+      } else {
+        do_string(file);
+      }
+    } else if (field->kind == NumberValue && (*file->rindex == '-' || (*file->rindex >= '0' && *file->rindex <= '9'))) {
+      do_number_value(file);
+    } else if (*file->rindex && strchr("\"{[tfn-0123456789", *file->rindex)) {
+      do_values(file, None, 0, 1);
+    } else {
+      do_values(file, Object, field > template->fields, 0);
+      return 0;
+    }
+  }
+  if (template->tail_length && (size_t) (file->data_end - file->rindex) == template->tail_length &&
+      equal_bytes(file->rindex, bytes + template->tail, template->tail_length)) {
+    write_layout(file, template->tail_length, (const uint8_t*) "}", 1);
+    return 1;
+  }
+  drop_space(file);
+  if (!template->count) {
+    if (*file->rindex != '{') {
+      do_value(file);
+      return 0;
+    }
+    ++(file->rindex);
+    drop_space(file);
+  }
+  if (*file->rindex != '}') {
+    if (!template->count) {
+      do_object(file);
+    }
+    do_values(file, Object, template->count > 0, 0);
+    return 0;
+  }
+  ++(file->rindex);
+  matched = skip_space(file->rindex) >= file->data_end;
+  do_values(file, None, 1, 0);
+  return matched;
+}
+
+// Minifies a line with the file's template. In learning mode, a line that does not match makes the
+// next one the template.
+static void do_template(File* file) {
+  Template* template = file->template;
+  int learned = 0;
+  if (skip_space(file->rindex) >= file->data_end) { // blank line
+    do_value(file);
+    return;
+  }
+  ++(file->records);
+  if (template->learn && !template->valid) {
+    learned = template->valid = read_template(template, file->rindex, file->data_end, 0) == 0;
+  }
+  if (!template->valid) {
+    do_value(file);
+  } else if (do_record(file, template)) {
+    file->record_hits += !learned;
+  } else if (template->learn) {
+    template->valid = 0;
+  }
+}
+#endif
+
+// Returns the first quote or byte <= ' ' at or after i, which is at the latest the NUL at data_end
+static uint8_t* find_space_or_quote(uint8_t* i) {
+#ifdef __SSE2__
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i space = _mm_set1_epi8(' ');
+  int mask;
+  for (;; i += 16) {
+    const __m128i bytes = _mm_loadu_si128((const __m128i*) i);
+    if ((mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(bytes, quote), _mm_cmpeq_epi8(_mm_max_epu8(bytes, space), space))))) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#else
+  while (*i != '"' && *i > ' ') {
+    ++i;
+  }
+  return i;
+#endif
+}
+
+// Remove whitespace outside of strings and leave all other bytes untouched
+static void do_whitespace(File* file) {
+  uint8_t* i;
+  while (*file->rindex || file->rindex < file->data_end) {
+    switch (*file->rindex) {
+      case ' ':
+      case '\t':
+      case '\n':
+      case '\r':
+        for (i = file->rindex + 1; *i == ' ' || *i == '\t' || *i == '\n' || *i == '\r'; ++i);
+        write_data(file, i - file->rindex);
+        break;
+      case '"':
+        i = find_string_end(file->rindex + 1, file->data_end);
+        file->rindex = i < file->data_end ? i + 1 : file->data_end;
+        break;
+      default:
+        file->rindex = find_space_or_quote(file->rindex + 1);
+    }
+  }
+}
+
+// Scans the range with a NUL written at data_end, which the scanners stop at instead of checking
+// bounds. The byte is restored afterwards.
+static void do_range(File* file) {
+  const uint8_t end_byte = *file->data_end;
+  *file->data_end = 0;
+  if (file->options->whitespace_only) {
+    do_whitespace(file);
+#ifndef LIGHTERJSON_LIBRARY
+  } else if (file->template) {
+    do_template(file);
+#endif
+  } else {
+    do_value(file);
+  }
+  *file->data_end = end_byte;
+}
+
+// Minify one record per line. Empty lines are dropped unless newlines == 2.
+static void do_lines(File* file) {
+  uint8_t* data_end = file->data_end;
+  uint8_t* line_end;
+  uint8_t* output_start;
+  while (file->rindex < data_end) {
+    if ((size_t) (file->rindex - file->data_start) >= file->next_sample && !file->options->whitespace_only) {
+      choose_kernel(file); // before data_end is narrowed, so the sample spans several lines
+    }
+    line_end = memchr(file->rindex, '\n', data_end - file->rindex);
+    file->data_end = line_end ? line_end : data_end;
+    output_start = file->windex + (file->rindex - file->lindex);
+    do_range(file);
+    file->data_end = data_end;
+    if (!line_end) {
+      break;
+    }
+    if (file->options->ndjson == 2 || file->windex + (file->rindex - file->lindex) > output_start) {
+      ++(file->rindex);
+    } else {
+      write_data(file, 1);
+    }
+  }
+}
+
+// Writes to the byte at data_end and may read LJSON_PADDING bytes past it. In NDJSON mode that only
+// happens when the last line does not end in a newline, so ranges ending after one need no padding.
+static void do_document(File* file) {
+  if (file->options->ndjson) {
+    do_lines(file);
+  } else {
+    do_range(file);
+  }
+}
+
+// Returns the minified length and stores the kernels chosen, as in File
+static size_t minify_range(uint8_t* data, size_t length, const ljson_options* options, unsigned* kernels) {
+  File file = {data, data, data, data, data + length, options};
+  do_document(&file);
+  write_data(&file, 0);
+  *kernels = file.kernels;
+  return file.windex - data;
+}
+
+// ljson_minify, also storing the kernels chosen for the command-line statistics
+static size_t minify_buffer(uint8_t* data, size_t length, const ljson_options* options, unsigned* kernels) {
+  static const ljson_options defaults = {INT64_MAX, 0};
+  if (!options) {
+    options = &defaults;
+  }
+  length = minify_range(data, length, options, kernels);
+  if (options->ndjson == 1 && length && data[length - 1] == '\n') {
+    --length;
+  }
+  return length;
+}
+
+size_t ljson_minify(uint8_t* data, size_t length, const ljson_options* options) {
+  unsigned kernels;
+  return minify_buffer(data, length, options, &kernels);
+}
+
+typedef struct Chunk {
+  uint8_t* start;
+  size_t length; // input length, then minified length
+  unsigned kernels;
+} Chunk;
+
+struct ljson_job {
+  ljson_job* next;
+  ljson_pool* pool;
+  uint8_t* data;
+  size_t length;
+  ljson_options options;
+  ljson_callback callback;
+  void* user;
+  Chunk* chunks;
+  size_t chunk_count;
+  size_t next_chunk;  // next chunk to hand to a thread
+  size_t chunks_done;
+  unsigned kernels;   // chosen for any chunk, as in File
+  int status;
+  int finished;
+  int references;     // one for the pool and one for the handle
+};
+
+struct ljson_pool {
+  pthread_mutex_t lock;
+  pthread_cond_t work;     // a job was queued, or the pool is stopping
+  pthread_cond_t space;    // a job finished, so a blocked submitter may proceed
+  pthread_cond_t finished; // for ljson_wait
+  ljson_job* head;         // jobs with chunks not yet handed out
+  ljson_job* tail;
+  size_t outstanding;
+  size_t capacity;
+  size_t thread_count;
+  pthread_t* threads;
+  int stopping;
+};
+
+static void unlink_job(ljson_pool* pool, ljson_job* job) {
+  ljson_job** link = &pool->head;
+  ljson_job* previous = NULL;
+  for (; *link && *link != job; link = &(*link)->next) {
+    previous = *link;
+  }
+  if (*link) {
+    *link = job->next;
+    if (pool->tail == job) {
+      pool->tail = previous;
+    }
+  }
+}
+
+static void release_job(ljson_job* job) {
+  if (!--job->references) {
+    free(job->chunks);
+    free(job);
+  }
+}
+
+// Called without the lock once every chunk has finished or been skipped
+static void finish_job(ljson_job* job) {
+  ljson_pool* pool = job->pool;
+  uint8_t* windex = job->data;
+  if (job->status == LJSON_OK) {
+    for (size_t i = 0; i < job->chunk_count; ++i) {
+      memmove(windex, job->chunks[i].start, job->chunks[i].length);
+      windex += job->chunks[i].length;
+      job->kernels |= job->chunks[i].kernels;
+    }
+    job->length = windex - job->data;
+    if (job->options.ndjson == 1 && job->length && job->data[job->length - 1] == '\n') {
+      --(job->length);
+    }
+  }
+  if (job->callback) {
+    job->callback(job->data, job->length, job->status, job->user);
+  }
+  pthread_mutex_lock(&pool->lock);
+  job->finished = 1;
+  --(pool->outstanding);
+  pthread_cond_broadcast(&pool->space);
+  pthread_cond_broadcast(&pool->finished);
+  release_job(job);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static void* pool_thread(void* arg) {
+  ljson_pool* pool = arg;
+  ljson_job* job;
+  Chunk* chunk;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (!pool->head && !pool->stopping) {
+      pthread_cond_wait(&pool->work, &pool->lock);
+    }
+    if (!(job = pool->head)) {
+      break;
+    }
+    // Threads take successive chunks of the oldest job, so one large job uses the whole pool
+    chunk = &job->chunks[job->next_chunk++];
+    if (job->next_chunk == job->chunk_count) {
+      unlink_job(pool, job);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    chunk->length = minify_range(chunk->start, chunk->length, &job->options, &chunk->kernels);
+    pthread_mutex_lock(&pool->lock);
+    if (++(job->chunks_done) == job->chunk_count) {
+      pthread_mutex_unlock(&pool->lock);
+      finish_job(job);
+      pthread_mutex_lock(&pool->lock);
+    }
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+ljson_pool* ljson_pool_create(size_t threads, size_t capacity) {
+  ljson_pool* pool = calloc(1, sizeof(ljson_pool));
+  if (!pool) {
+    return NULL;
+  }
+  if (!threads) {
+    threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work, NULL);
+  pthread_cond_init(&pool->space, NULL);
+  pthread_cond_init(&pool->finished, NULL);
+  pool->capacity = capacity ? capacity : 1;
+  pool->threads = malloc(threads * sizeof(pthread_t));
+  for (; pool->thread_count < threads; ++(pool->thread_count)) {
+    if (pthread_create(&pool->threads[pool->thread_count], NULL, pool_thread, pool) != 0) {
+      break;
+    }
+  }
+  if (!pool->thread_count) {
+    free(pool->threads);
+    free(pool);
+    return NULL;
+  }
+  return pool;
+}
+
+void ljson_pool_destroy(ljson_pool* pool) {
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 1;
+  pthread_cond_broadcast(&pool->work);
+  while (pool->outstanding) {
+    pthread_cond_wait(&pool->space, &pool->lock);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  for (size_t i = 0; i < pool->thread_count; ++i) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->work);
+  pthread_cond_destroy(&pool->space);
+  pthread_cond_destroy(&pool->finished);
+  free(pool->threads);
+  free(pool);
+}
+
+static ljson_job* submit_job(ljson_pool* pool, uint8_t* data, size_t length, const ljson_options* options,
+                             ljson_callback callback, void* user, int block) {
+  static const ljson_options defaults = {INT64_MAX, 0};
+  ljson_job* job = calloc(1, sizeof(ljson_job));
+  uint8_t* start = data;
+  uint8_t* end;
+  if (!job) {
+    return NULL;
+  }
+  job->pool = pool;
+  job->data = data;
+  job->length = length;
+  job->options = options ? *options : defaults;
+  job->callback = callback;
+  job->user = user;
+  job->references = 2;
+  // Split NDJSON after the first newline past each LJSON_CHUNK bytes; lines are minified independently
+  job->chunks = malloc((job->options.ndjson ? length / LJSON_CHUNK + 1 : 1) * sizeof(Chunk));
+  if (!job->chunks) {
+    free(job);
+    return NULL;
+  }
+  do {
+    end = data + length;
+    if (job->options.ndjson && end - start > 2 * LJSON_CHUNK && (end = memchr(start + LJSON_CHUNK, '\n', end - start - LJSON_CHUNK))) {
+      ++end;
+    } else {
+      end = data + length;
+    }
+    job->chunks[job->chunk_count++] = (Chunk) {start, end - start};
+    start = end;
+  } while (start < data + length);
+  pthread_mutex_lock(&pool->lock);
+  while (pool->outstanding >= pool->capacity || pool->stopping) {
+    if (!block || pool->stopping) {
+      pthread_mutex_unlock(&pool->lock);
+      free(job->chunks);
+      free(job);
+      errno = pool->stopping ? EINVAL : EAGAIN;
+      return NULL;
+    }
+    pthread_cond_wait(&pool->space, &pool->lock);
+  }
+  ++(pool->outstanding);
+  if (pool->tail) {
+    pool->tail->next = job;
+  } else {
+    pool->head = job;
+  }
+  pool->tail = job;
+  pthread_cond_broadcast(&pool->work);
+  pthread_mutex_unlock(&pool->lock);
+  return job;
+}
+
+ljson_job* ljson_submit(ljson_pool* pool, uint8_t* data, size_t length, const ljson_options* options,
+                        ljson_callback callback, void* user) {
+  return submit_job(pool, data, length, options, callback, user, 1);
+}
+
+ljson_job* ljson_try_submit(ljson_pool* pool, uint8_t* data, size_t length, const ljson_options* options,
+                            ljson_callback callback, void* user) {
+  return submit_job(pool, data, length, options, callback, user, 0);
+}
+
+int ljson_cancel(ljson_job* job) {
+  ljson_pool* pool = job->pool;
+  int complete;
+  pthread_mutex_lock(&pool->lock);
+  if (job->finished || job->status == LJSON_CANCELLED || job->chunks_done == job->chunk_count) {
+    pthread_mutex_unlock(&pool->lock);
+    return -1;
+  }
+  job->status = LJSON_CANCELLED;
+  if (job->next_chunk < job->chunk_count) {
+    unlink_job(pool, job);
+    job->chunks_done += job->chunk_count - job->next_chunk;
+    job->next_chunk = job->chunk_count;
+  }
+  complete = job->chunks_done == job->chunk_count;
+  pthread_mutex_unlock(&pool->lock);
+  if (complete) {
+    finish_job(job);
+  }
+  return 0;
+}
+
+// ljson_wait, also storing the kernels chosen if kernels is not NULL
+static int wait_job(ljson_job* job, size_t* length, unsigned* kernels) {
+  ljson_pool* pool = job->pool;
+  int status;
+  pthread_mutex_lock(&pool->lock);
+  while (!job->finished) {
+    pthread_cond_wait(&pool->finished, &pool->lock);
+  }
+  status = job->status;
+  if (length) {
+    *length = job->length;
+  }
+  if (kernels) {
+    *kernels = job->kernels;
+  }
+  release_job(job);
+  pthread_mutex_unlock(&pool->lock);
+  return status;
+}
+
+int ljson_wait(ljson_job* job, size_t* length) {
+  return wait_job(job, length, NULL);
+}
+
+void ljson_release(ljson_job* job) {
+  ljson_pool* pool = job->pool;
+  pthread_mutex_lock(&pool->lock);
+  release_job(job);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+// The rest is the command-line tool, which liblighterjson.a leaves out
+#ifndef LIGHTERJSON_LIBRARY
+static const char* const kernel_names[] = {"generic", "strings", "numbers", "compact"};
+
+// Writes " (kernels: NAME, ...)" for the per-file statistics into text, which must hold 64 bytes, or
+// nothing if no kernel was chosen, as with -w
+static const char* describe_kernels(unsigned kernels, char text[]) {
+  char* end = text;
+  *text = 0;
+  for (size_t i = 0; i < KERNEL_COUNT; ++i) {
+    if (kernels & (1u << i)) {
+      end += sprintf(end, "%s%s", end == text ? " (kernels: " : ", ", kernel_names[i]);
+    }
+  }
+  if (end > text) {
+    strcpy(end, ")");
+  }
+  return text;
+}
+
+// Per-file latency bounds in seconds and size bounds in bytes for the metrics histograms
+static const double latency_bounds[] = {0.00001, 0.00005, 0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5, 10};
+static const double size_bounds[] = {256, 1024, 4096, 16384, 65536, 262144, 1048576, 4194304, 16777216, 67108864, 268435456, 1073741824};
+#define LATENCY_BUCKETS (sizeof(latency_bounds) / sizeof(double) + 1)
+#define SIZE_BUCKETS (sizeof(size_bounds) / sizeof(double) + 1)
+
+// Each thread only writes its own accumulator, so updates are plain relaxed stores. The exporter sums
+// all of them. Accumulators of exited threads are reused by new ones so the totals stay monotonic.
+typedef struct Metrics {
+  struct Metrics* next;
+  atomic_int in_use;
+  _Atomic uint64_t files;
+  _Atomic uint64_t errors;
+  _Atomic uint64_t bytes_in;
+  _Atomic uint64_t bytes_out;
+  _Atomic uint64_t latency_ns;
+  _Atomic uint64_t latency[LATENCY_BUCKETS];
+  _Atomic uint64_t size[SIZE_BUCKETS];
+  _Atomic uint64_t kernels[KERNEL_COUNT];
+  _Atomic uint64_t records;
+  _Atomic uint64_t record_hits;
+} Metrics;
+
+static _Atomic(Metrics*) metrics_list;
+static _Thread_local Metrics* thread_metrics;
+static pthread_key_t metrics_key;
+static pthread_once_t metrics_once = PTHREAD_ONCE_INIT;
+
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static void release_metrics(void* metrics) {
+  atomic_store(&((Metrics*) metrics)->in_use, 0);
+}
+
+static void create_metrics_key(void) {
+  pthread_key_create(&metrics_key, release_metrics);
+}
+
+static Metrics* claim_metrics(void) {
+  Metrics* metrics;
+  int unused;
+  for (metrics = atomic_load(&metrics_list); metrics; metrics = metrics->next) {
+    unused = 0;
+    if (atomic_compare_exchange_strong(&metrics->in_use, &unused, 1)) {
+      break;
+    }
+  }
+  if (!metrics) {
+    metrics = calloc(1, sizeof(Metrics));
+    metrics->in_use = 1;
+    metrics->next = atomic_load(&metrics_list);
+    while (!atomic_compare_exchange_weak(&metrics_list, &metrics->next, metrics));
+  }
+  pthread_once(&metrics_once, create_metrics_key);
+  pthread_setspecific(metrics_key, metrics);
+  return metrics;
+}
+
+static void add_metric(_Atomic uint64_t* counter, uint64_t value) {
+  atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + value, memory_order_relaxed);
+}
+
+static size_t bucket(const double bounds[], size_t count, double value) {
+  size_t i = 0;
+  while (i < count && value > bounds[i]) {
+    ++i;
+  }
+  return i;
+}
+
+static void record_metrics(uint64_t bytes_in, uint64_t bytes_out, uint64_t started, int error) {
+  Metrics* metrics = thread_metrics ? thread_metrics : (thread_metrics = claim_metrics());
+  uint64_t elapsed = monotonic_ns() - started;
+  add_metric(&metrics->files, 1);
+  add_metric(&metrics->errors, error != 0);
+  add_metric(&metrics->bytes_in, bytes_in);
+  add_metric(&metrics->bytes_out, bytes_out);
+  add_metric(&metrics->latency_ns, elapsed);
+  add_metric(&metrics->latency[bucket(latency_bounds, LATENCY_BUCKETS - 1, elapsed / 1e9)], 1);
+  add_metric(&metrics->size[bucket(size_bounds, SIZE_BUCKETS - 1, bytes_in)], 1);
+}
+
+static void record_kernel(Kernel kernel) {
+  if (metrics_path) {
+    Metrics* metrics = thread_metrics ? thread_metrics : (thread_metrics = claim_metrics());
+    add_metric(&metrics->kernels[kernel], 1);
+  }
+}
+
+static void record_template(uint64_t records, uint64_t hits) {
+  if (metrics_path) {
+    Metrics* metrics = thread_metrics ? thread_metrics : (thread_metrics = claim_metrics());
+    add_metric(&metrics->records, records);
+    add_metric(&metrics->record_hits, hits);
+  }
+}
+
+static void write_histogram(FILE* stream, const char name[], const char help[], const double bounds[], size_t count,
+                            const uint64_t buckets[], double sum) {
+  uint64_t cumulative = 0;
+  fprintf(stream, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+  for (size_t i = 0; i < count; ++i) {
+    cumulative += buckets[i];
+    if (i + 1 < count) {
+      fprintf(stream, "%s_bucket{le=\"%.10g\"} %" PRIu64 "\n", name, bounds[i], cumulative);
+    } else {
+      fprintf(stream, "%s_bucket{le=\"+Inf\"} %" PRIu64 "\n", name, cumulative);
+    }
+  }
+  fprintf(stream, "%s_sum %.9g\n%s_count %" PRIu64 "\n", name, sum, name, cumulative);
+}
+
+// Writes the Prometheus text format through a temporary file, as the textfile collector expects
+static int write_metrics(void) {
+  Metrics total = {0};
+  uint64_t latency[LATENCY_BUCKETS] = {0};
+  uint64_t size[SIZE_BUCKETS] = {0};
+  uint64_t kernels[KERNEL_COUNT] = {0};
+  char* temp_path = malloc(strlen(metrics_path) + 5);
+  FILE* stream;
+  for (Metrics* metrics = atomic_load(&metrics_list); metrics; metrics = metrics->next) {
+    total.files += atomic_load_explicit(&metrics->files, memory_order_relaxed);
+    total.errors += atomic_load_explicit(&metrics->errors, memory_order_relaxed);
+    total.bytes_in += atomic_load_explicit(&metrics->bytes_in, memory_order_relaxed);
+    total.bytes_out += atomic_load_explicit(&metrics->bytes_out, memory_order_relaxed);
+    total.latency_ns += atomic_load_explicit(&metrics->latency_ns, memory_order_relaxed);
+    for (size_t i = 0; i < LATENCY_BUCKETS; ++i) {
+      latency[i] += atomic_load_explicit(&metrics->latency[i], memory_order_relaxed);
+    }
+    for (size_t i = 0; i < SIZE_BUCKETS; ++i) {
+      size[i] += atomic_load_explicit(&metrics->size[i], memory_order_relaxed);
+    }
+    for (size_t i = 0; i < KERNEL_COUNT; ++i) {
+      kernels[i] += atomic_load_explicit(&metrics->kernels[i], memory_order_relaxed);
+    }
+    total.records += atomic_load_explicit(&metrics->records, memory_order_relaxed);
+    total.record_hits += atomic_load_explicit(&metrics->record_hits, memory_order_relaxed);
+  }
+  sprintf(temp_path, "%s.tmp", metrics_path);
+  if (!(stream = fopen(temp_path, "w"))) {
+    fprintf(stderr, "Could not write %s: %s\n", temp_path, strerror(errno));
+    free(temp_path);
+    return EXIT_FAILURE;
+  }
+  fprintf(stream, "# HELP lighterjson_files_total Files, server requests or ring slots processed.\n"
+                  "# TYPE lighterjson_files_total counter\nlighterjson_files_total %" PRIu64 "\n"
+                  "# HELP lighterjson_errors_total Files that could not be processed.\n"
+                  "# TYPE lighterjson_errors_total counter\nlighterjson_errors_total %" PRIu64 "\n"
+                  "# HELP lighterjson_bytes_in_total Bytes read.\n"
+                  "# TYPE lighterjson_bytes_in_total counter\nlighterjson_bytes_in_total %" PRIu64 "\n"
+                  "# HELP lighterjson_bytes_out_total Bytes written after minification.\n"
+                  "# TYPE lighterjson_bytes_out_total counter\nlighterjson_bytes_out_total %" PRIu64 "\n",
+          (uint64_t) total.files, (uint64_t) total.errors, (uint64_t) total.bytes_in, (uint64_t) total.bytes_out);
+  write_histogram(stream, "lighterjson_latency_seconds", "Time to process one file.", latency_bounds, LATENCY_BUCKETS,
+                  latency, total.latency_ns / 1e9);
+  write_histogram(stream, "lighterjson_size_bytes", "Input size of each file.", size_bounds, SIZE_BUCKETS, size, total.bytes_in);
+  fprintf(stream, "# HELP lighterjson_kernel_selections_total Sampled regions minified by each scanning kernel.\n"
+                  "# TYPE lighterjson_kernel_selections_total counter\n");
+  for (size_t i = 0; i < KERNEL_COUNT; ++i) {
+    fprintf(stream, "lighterjson_kernel_selections_total{kernel=\"%s\"} %" PRIu64 "\n", kernel_names[i], kernels[i]);
+  }
+  fprintf(stream, "# HELP lighterjson_template_lines_total NDJSON lines minified with --schema.\n"
+                  "# TYPE lighterjson_template_lines_total counter\nlighterjson_template_lines_total %" PRIu64 "\n"
+                  "# HELP lighterjson_template_hits_total Lines that matched the schema or the template learned from an earlier line.\n"
+                  "# TYPE lighterjson_template_hits_total counter\nlighterjson_template_hits_total %" PRIu64 "\n",
+          (uint64_t) total.records, (uint64_t) total.record_hits);
+  if (fclose(stream) != 0 || rename(temp_path, metrics_path) < 0) {
+    fprintf(stderr, "Could not write %s: %s\n", metrics_path, strerror(errno));
+    free(temp_path);
+    return EXIT_FAILURE;
+  }
+  free(temp_path);
+  return EXIT_SUCCESS;
+}
+
+static void* metrics_thread(void* arg) {
+  for (;;) {
+    sleep(METRICS_INTERVAL);
+    write_metrics();
+  }
+  return NULL;
+}
+
+// Writes the last snapshot when a mode returns, so the final interval is not lost
+static int finish_metrics(int exit_code) {
+  if (metrics_path && write_metrics() != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  return exit_code;
+}
+
+static void request_stop(int signal_number) {
+  stop_requested = 1;
+}
+
+static uint64_t hash_path(const char path[]) {
+  return hash_bytes((const uint8_t*) path, strlen(path));
+}
+
+// Identifies the already minified prefix of a file, to notice when it was replaced by a longer one
+static uint64_t hash_tail(const uint8_t* data, uint64_t offset) {
+  return hash_bytes(data + offset - (offset < 64 ? offset : 64), offset < 64 ? offset : 64);
+}
+
+static int compare_progress(const void* a, const void* b) {
+  return strcmp(((const Progress*) a)->path, ((const Progress*) b)->path);
+}
+
+static Progress* find_progress(char path[]) {
+  Progress key = {path};
+  // The table is NULL until the first file is added, and bsearch must not be given a NULL array
+  return progress_count ? bsearch(&key, progress_entries, progress_count, sizeof(Progress), compare_progress) : NULL;
+}
+
+static Progress* add_progress(char path[]) {
+  size_t i = 0;
+  if (progress_count == progress_size) {
+    progress_size = progress_size ? progress_size * 2 : 64;
+    progress_entries = realloc(progress_entries, progress_size * sizeof(Progress));
+  }
+  while (i < progress_count && strcmp(progress_entries[i].path, path) < 0) {
+    ++i;
+  }
+  memmove(progress_entries + i + 1, progress_entries + i, (progress_count++ - i) * sizeof(Progress));
+  memset(progress_entries + i, 0, sizeof(Progress));
+  progress_entries[i].path = strdup(path);
+  return progress_entries + i;
+}
+
+// State file lines are "offset size inode fingerprint path"
+static int load_progress(void) {
+  FILE* stream = fopen(state_path, "r");
+  char* line = NULL;
+  size_t capacity = 0;
+  ssize_t length;
+  int path_start;
+  Progress entry;
+  Progress* progress;
+  if (!stream) {
+    return errno == ENOENT ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+  while ((length = getline(&line, &capacity, stream)) > 0) {
+    if (line[length - 1] == '\n') {
+      line[length - 1] = 0;
+    }
+    if (sscanf(line, "%" SCNu64 " %" SCNu64 " %" SCNu64 " %" SCNu64 " %n", &entry.offset, &entry.size, &entry.inode, &entry.fingerprint, &path_start) == 4 && line[path_start]) {
+      progress = add_progress(line + path_start);
+      progress->offset = entry.offset;
+      progress->size = entry.size;
+      progress->inode = entry.inode;
+      progress->fingerprint = entry.fingerprint;
+    }
+  }
+  free(line);
+  fclose(stream);
+  return EXIT_SUCCESS;
+}
+
+// Replaces the state file atomically so an interrupted run cannot lose it
+static int save_progress(void) {
+  char* temp_path = malloc(strlen(state_path) + 5);
+  FILE* stream;
+  sprintf(temp_path, "%s.tmp", state_path);
+  if (!(stream = fopen(temp_path, "w"))) {
+    fprintf(stderr, "Could not write %s: %s\n", temp_path, strerror(errno));
+    free(temp_path);
+    return EXIT_FAILURE;
+  }
+  for (size_t i = 0; i < progress_count; ++i) {
+    fprintf(stream, "%" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %s\n", progress_entries[i].offset,
+            progress_entries[i].size, progress_entries[i].inode, progress_entries[i].fingerprint, progress_entries[i].path);
+  }
+  if (fclose(stream) != 0 || rename(temp_path, state_path) < 0) {
+    fprintf(stderr, "Could not write %s: %s\n", state_path, strerror(errno));
+    free(temp_path);
+    return EXIT_FAILURE;
+  }
+  free(temp_path);
+  return EXIT_SUCCESS;
+}
+
+static int in_shard(const char path[]) {
+  return shard_count <= 1 || hash_path(path) % shard_count == shard_index;
+}
+
+static int is_json_name(const char name[]) {
+  size_t length = strlen(name);
+  return length >= 5 && strcmp(name + length - 5, ".json") == 0;
+}
+
+// Minifies the oldest queued file
+static int do_queued_file(void) {
+  FoundFile* found = &lookahead.files[lookahead.head];
+  int exit_code;
+  lookahead.bytes -= found->readahead;
+  ++lookahead.head;
+  --lookahead.count;
+  exit_code = start_file(found->path, found->relative_start);
+  free(found->path);
+  return exit_code;
+}
+
+// Queues a file behind the ones found before it and asks the kernel to start reading it, so that
+// cold reads overlap with minifying the earlier files. Files are minified in order once the files
+// after them would exceed readahead_budget bytes, or by finish_queue.
+static int queue_file(char path[], size_t relative_start) {
+  struct stat sb;
+  uint64_t length = 0;
+  int exit_code = EXIT_SUCCESS;
+  int fd;
+  if (!readahead_budget) {
+    return start_file(path, relative_start);
+  }
+  if ((fd = open(path, O_RDONLY)) >= 0) { // errors are reported when the file is minified
+    if (fstat(fd, &sb) == 0) {
+      length = (uint64_t) sb.st_size < readahead_budget ? (uint64_t) sb.st_size : readahead_budget;
+    }
+  }
+  while (lookahead.count && lookahead.bytes + length > readahead_budget) {
+    if (do_queued_file() != EXIT_SUCCESS) {
+      exit_code = EXIT_FAILURE;
+    }
+  }
+#ifdef POSIX_FADV_WILLNEED
+  if (fd >= 0 && length) {
+    posix_fadvise(fd, 0, length, POSIX_FADV_WILLNEED);
+  }
+#endif
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (lookahead.head + lookahead.count == lookahead.capacity) {
+    if (lookahead.head) {
+      memmove(lookahead.files, lookahead.files + lookahead.head, lookahead.count * sizeof(FoundFile));
+      lookahead.head = 0;
+    } else {
+      lookahead.capacity = lookahead.capacity ? lookahead.capacity * 2 : 64;
+      lookahead.files = realloc(lookahead.files, lookahead.capacity * sizeof(FoundFile));
+    }
+  }
+  lookahead.files[lookahead.head + lookahead.count] = (FoundFile) {strdup(path), relative_start, length};
+  ++lookahead.count;
+  lookahead.bytes += length;
+  return exit_code;
+}
+
+// Minifies the files still queued and finishes the ones in flight
+static int finish_queue(void) {
+  int exit_code = EXIT_SUCCESS;
+  while (lookahead.count) {
+    if (do_queued_file() != EXIT_SUCCESS) {
+      exit_code = EXIT_FAILURE;
+    }
+  }
+  free(lookahead.files);
+  lookahead.files = NULL;
+  lookahead.capacity = lookahead.head = 0;
+  if (batch.pool) {
+    if (flush_files(0) != EXIT_SUCCESS) {
+      exit_code = EXIT_FAILURE;
+    }
+    ljson_pool_destroy(batch.pool);
+    free(batch.entries);
+    batch.pool = NULL;
+  }
+  return exit_code;
+}
+
+// relative_start is the offset of the path relative to the traversal root, which is what gets sharded
+static int do_dir(char path[], size_t relative_start) {
+  DIR *dir;
+  struct dirent *entry;
+  char* child;
+  size_t path_length = strlen(path);
+  int exit_code = EXIT_SUCCESS;
+  dir = opendir(path);
+  if (!dir) {
+    fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+      continue;
+    }
+    if (entry->d_type != DT_DIR && !is_json_name(entry->d_name)) {
+      continue;
+    }
+    child = malloc(path_length + strlen(entry->d_name) + 2);
+    sprintf(child, path_length && path[path_length - 1] == '/' ? "%s%s" : "%s/%s", path, entry->d_name);
+    if (entry->d_type == DT_DIR) {
+      if (do_dir(child, relative_start) != EXIT_SUCCESS) {
+        exit_code = EXIT_FAILURE;
+      }
+    } else if (in_shard(child + relative_start) && queue_file(child, relative_start) != EXIT_SUCCESS) {
+      exit_code = EXIT_FAILURE;
+    }
+    free(child);
+  }
+  closedir(dir);
+  return exit_code;
+}
+
+static int do_path(char path[]) {
+  struct stat sb;
+  if (stat(path, &sb) < 0) {
+    fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+    if (metrics_path) {
+      record_metrics(0, 0, monotonic_ns(), 1);
+    }
+    return EXIT_FAILURE;
+  }
+  if (S_ISDIR(sb.st_mode)) {
+    return do_dir(path, strlen(path) + (*path && path[strlen(path) - 1] != '/'));
+  }
+  if (!in_shard(path)) {
+    return EXIT_SUCCESS;
+  }
+  return queue_file(path, 0);
+}
+
+// Process NUL-separated paths, such as the output of find -print0
+static int do_files_from(char list[]) {
+  FILE* stream = strcmp(list, "-") ? fopen(list, "r") : stdin;
+  char* path = NULL;
+  size_t capacity = 0;
+  int exit_code = EXIT_SUCCESS;
+  if (!stream) {
+    fprintf(stderr, "Could not open %s: %s\n", list, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  while (getdelim(&path, &capacity, '\0', stream) > 0) {
+    if (*path && do_path(path) != EXIT_SUCCESS) {
+      exit_code = EXIT_FAILURE;
+    }
+  }
+  free(path);
+  if (stream != stdin) {
+    fclose(stream);
+  }
+  return exit_code;
+}
+
+// Size of the reservation map_padded makes for size bytes
+static size_t padded_size(size_t size) {
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  return ((size + page_size - 1) & ~(page_size - 1)) + page_size;
+}
+
+// Maps size bytes of fd over the start of a private reservation, so at least a page past the end is
+// writable for the sentinel and for scanners reading ahead of it. Unmap padded_size(size) bytes.
+static uint8_t* map_padded(int fd, size_t size, int flags) {
+  uint8_t* data = mmap(NULL, padded_size(size), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (data != MAP_FAILED && size && mmap(data, size, PROT_READ | PROT_WRITE, flags | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    munmap(data, padded_size(size));
+    return MAP_FAILED;
+  }
+  return data;
+}
+
+// Writes a path for a tab-separated file, escaping backslashes, tabs and newlines as \\, \t and \n
+static void write_escaped_path(FILE* stream, const char path[]) {
+  for (const char* i = path; *i; ++i) {
+    if (*i == '\\' || *i == '\t' || *i == '\n') {
+      fputc('\\', stream);
+      fputc(*i == '\t' ? 't' : *i == '\n' ? 'n' : '\\', stream);
+    } else {
+      fputc(*i, stream);
+    }
+  }
+}
+
+// Adds a "path\tbytes in\tbytes out" line to the --manifest file, with "error" as the size of a
+// file that could not be minified
+static void record_manifest(const char path[], uint64_t bytes_in, uint64_t bytes_out, int error) {
+  write_escaped_path(manifest, path);
+  if (error) {
+    fprintf(manifest, "\t%" PRIu64 "\terror\n", bytes_in);
+  } else {
+    fprintf(manifest, "\t%" PRIu64 "\t%" PRIu64 "\n", bytes_in, bytes_out);
+  }
+}
+
+static int close_manifest(int exit_code) {
+  if (manifest && (ferror(manifest) | fclose(manifest))) {
+    fprintf(stderr, "Could not write %s: %s\n", manifest_path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  return exit_code;
+}
+
+// relative_start is the offset of the part of filename that --manifest records
+static int do_file(char filename[], size_t relative_start) {
+  if (bundle_path) {
+    return bundle_file(filename);
+  }
+  File file = {.options = &options};
+  uint64_t started = metrics_path ? monotonic_ns() : 0;
+  Progress* progress = NULL;
+  uint8_t* tail;
+  int fd;
+  struct stat sb = {0};
+  char* index_path;
+  char kernel_text[64];
+  int exit_code = EXIT_SUCCESS;
+  fd = open(filename, O_RDWR); 
+  if (fd < 0) {
+    fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+    exit_code = EXIT_FAILURE;
+    goto close_descriptors_and_return;
+  }
+  if (!quiet) {
+    printf("%s: ", filename);
+  }
+  fstat(fd, &sb);
+  file.data_start = map_padded(fd, sb.st_size, MAP_SHARED);
+  if (file.data_start == MAP_FAILED) {
+    fprintf(stderr, "Could not map file\n");
+    exit_code = EXIT_FAILURE;
+    goto close_descriptors_and_return;
+  }
+  file.rindex = file.windex = file.lindex = file.data_start;
+  file.data_end = file.data_start + sb.st_size;
+  file.stream_span = sb.st_size >= STREAM_FILE ? stream_threshold : 0;
+  if (file.data_end - file.data_start > 2 && (*file.data_start == 0 || *(file.data_start + 1) == 0)) {
+    fprintf(stderr, "Only UTF-8 input is currently supported\n");
+    exit_code = EXIT_FAILURE;
+    goto close_descriptors_and_return;
+  }
+  if (state_path) {
+    // Resume after the last complete line, and leave a partially written line for the next run
+    progress = find_progress(filename);
+    if (progress && progress->inode == sb.st_ino && progress->size <= sb.st_size &&
+        progress->fingerprint == hash_tail(file.data_start, progress->offset)) {
+      file.rindex = file.windex = file.lindex = file.data_start + progress->offset;
+    } else if (!progress) {
+      progress = add_progress(filename);
+    }
+    tail = file.data_end;
+    while (tail > file.rindex && *(tail - 1) != '\n') {
+      --tail;
+    }
+    file.data_end = tail;
+  }
+  if (schema_path || schema.learn) {
+    file.template = &schema;
+  }
+  do_document(&file);
+  write_data(&file, 0);
+  if (state_path) {
+    progress->offset = file.windex - file.data_start;
+    progress->fingerprint = hash_tail(file.data_start, progress->offset);
+    progress->inode = sb.st_ino;
+    file.rindex = file.data_end = file.data_start + sb.st_size;
+    write_data(&file, 0);
+    progress->size = file.windex - file.data_start;
+  }
+  if (options.ndjson == 1 && !state_path && file.windex > file.data_start && *(file.windex - 1) == '\n') {
+    --(file.windex); // clean up trailing newline in -n mode
+  }
+  if (msync(file.data_start, file.windex - file.data_start, MS_SYNC) < 0) {
+    fprintf(stderr, "Could not sync file: %s\n", strerror(errno));
+    exit_code = EXIT_FAILURE;
+    goto close_descriptors_and_return;
+  }
+  if (build_index) {
+    index_path = malloc(strlen(filename) + 5);
+    sprintf(index_path, "%s.idx", filename);
+    exit_code = write_index(index_path, file.data_start, file.windex);
+    free(index_path);
+  }
+  if (!quiet) {
+    printf("Saved %lu bytes%s\n", (unsigned long) (file.data_end - file.windex), describe_kernels(file.kernels, kernel_text));
+    if (file.records) { // on a line of its own, so that tools reading the line above still match it
+      printf("%s: Template matched %lu of %lu lines (%.1f%%)\n", filename, (unsigned long) file.record_hits,
+             (unsigned long) file.records, 100.0 * file.record_hits / file.records);
+    }
+  }
+
+  close_descriptors_and_return:
+  if (file.data_start != 0 && file.data_start != MAP_FAILED) {
+    munmap(file.data_start, padded_size(sb.st_size));
+  }
+  if (fd >= 0) {
+    // We truncate the file here because Cygwin mmap implementation opens a new file descriptor,
+    // and ftruncate fails if that descriptor is open with a "Permission denied" error
+    if (exit_code == EXIT_SUCCESS && ftruncate(fd, file.windex - file.data_start) < 0) {
+      fprintf(stderr, "Could not truncate file to new size: %s. It may have garbage characters at the end\n", strerror(errno));
+    }
+    close(fd);
+  }
+  if (metrics_path) {
+    record_metrics(sb.st_size, exit_code == EXIT_SUCCESS ? file.windex - file.data_start : 0, started, exit_code != EXIT_SUCCESS);
+    record_template(file.records, file.record_hits);
+  }
+  if (manifest) {
+    record_manifest(filename + relative_start, sb.st_size, file.windex - file.data_start, exit_code != EXIT_SUCCESS);
+  }
+  return exit_code;
+}
+
+// Syncs, indexes and truncates the oldest files in flight until at most keep remain, as do_file
+// does after minifying
+static int flush_files(size_t keep) {
+  Pending* entry;
+  size_t length;
+  unsigned kernels;
+  char* index_path;
+  char kernel_text[64];
+  int file_exit_code;
+  int exit_code = EXIT_SUCCESS;
+  for (; batch.count > keep; batch.head = (batch.head + 1) % batch.capacity, --batch.count) {
+    entry = &batch.entries[batch.head];
+    file_exit_code = EXIT_SUCCESS;
+    wait_job(entry->job, &length, &kernels);
+    if (msync(entry->data, length, MS_SYNC) < 0) {
+      fprintf(stderr, "Could not sync %s: %s\n", entry->path, strerror(errno));
+      file_exit_code = EXIT_FAILURE;
+    } else {
+      if (build_index) {
+        index_path = malloc(strlen(entry->path) + 5);
+        sprintf(index_path, "%s.idx", entry->path);
+        file_exit_code = write_index(index_path, entry->data, entry->data + length);
+        free(index_path);
+      }
+      if (!quiet) {
+        printf("%s: Saved %lu bytes%s\n", entry->path, (unsigned long) (entry->length - length),
+               describe_kernels(kernels, kernel_text));
+      }
+    }
+    munmap(entry->data, padded_size(entry->length));
+    if (file_exit_code == EXIT_SUCCESS && ftruncate(entry->fd, length) < 0) {
+      fprintf(stderr, "Could not truncate %s to new size: %s. It may have garbage characters at the end\n", entry->path, strerror(errno));
+    }
+    close(entry->fd);
+    if (metrics_path) {
+      record_metrics(entry->length, file_exit_code == EXIT_SUCCESS ? length : 0, entry->started, file_exit_code != EXIT_SUCCESS);
+    }
+    if (manifest) {
+      record_manifest(entry->path + entry->relative_start, entry->length, length, file_exit_code != EXIT_SUCCESS);
+    }
+    if (file_exit_code != EXIT_SUCCESS) {
+      exit_code = EXIT_FAILURE;
+    }
+    free(entry->path);
+  }
+  return exit_code;
+}
+
+// Maps a file and queues it on the pool, finishing older files first if the pool is full. Files
+// the pool cannot take, including those with errors for do_file to report, are minified by do_file
+// once the files before them are finished, so that output stays in order.
+static int start_file(char filename[], size_t relative_start) {
+  const size_t threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+  Pending* entry;
+  struct stat sb;
+  uint8_t* data = MAP_FAILED;
+  ljson_job* job = NULL;
+  uint64_t started;
+  int exit_code = EXIT_SUCCESS;
+  int fd;
+  if (bundle_path || state_path || schema_path || schema.learn) {
+    return do_file(filename, relative_start);
+  }
+  if (!batch.pool) {
+    batch.capacity = threads * 4;
+    batch.entries = malloc(batch.capacity * sizeof(Pending));
+    if (!(batch.pool = ljson_pool_create(threads, batch.capacity))) {
+      free(batch.entries);
+      return do_file(filename, relative_start);
+    }
+  }
+  if (flush_files(batch.capacity - 1) != EXIT_SUCCESS) {
+    exit_code = EXIT_FAILURE;
+  }
+  started = metrics_path ? monotonic_ns() : 0;
+  if ((fd = open(filename, O_RDWR)) >= 0 && fstat(fd, &sb) == 0 && sb.st_size < STREAM_FILE &&
+      (data = map_padded(fd, sb.st_size, MAP_SHARED)) != MAP_FAILED && (sb.st_size <= 2 || (data[0] && data[1]))) {
+    job = ljson_submit(batch.pool, data, sb.st_size, &options, NULL, NULL);
+  }
+  if (!job) {
+    if (data != MAP_FAILED) {
+      munmap(data, padded_size(sb.st_size));
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (flush_files(0) != EXIT_SUCCESS) {
+      exit_code = EXIT_FAILURE;
+    }
+    return do_file(filename, relative_start) == EXIT_SUCCESS ? exit_code : EXIT_FAILURE;
+  }
+  entry = &batch.entries[(batch.head + batch.count) % batch.capacity];
+  *entry = (Pending) {strdup(filename), data, sb.st_size, started, job, fd, relative_start};
+  ++batch.count;
+  return exit_code;
+}
+
+// Returns the first quote, bracket, brace or NUL at or after i
+static uint8_t* find_structural(uint8_t* i) {
+#ifdef __SSE2__
+  const __m128i quote = _mm_set1_epi8('"');
+  const __m128i case_bit = _mm_set1_epi8(0x20); // '[' | 0x20 == '{' and ']' | 0x20 == '}'
+  const __m128i open = _mm_set1_epi8('{');
+  const __m128i close = _mm_set1_epi8('}');
+  const __m128i zero = _mm_setzero_si128();
+  int mask;
+  for (;; i += 16) {
+    const __m128i bytes = _mm_loadu_si128((const __m128i*) i);
+    const __m128i folded = _mm_or_si128(bytes, case_bit);
+    if ((mask = _mm_movemask_epi8(_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(bytes, quote), _mm_cmpeq_epi8(bytes, zero)),
+                                               _mm_or_si128(_mm_cmpeq_epi8(folded, open), _mm_cmpeq_epi8(folded, close)))))) {
+      return i + __builtin_ctz(mask);
+    }
+  }
+#else
+  while (*i && *i != '"' && (*i | 0x20) != '{' && (*i | 0x20) != '}') {
+    ++i;
+  }
+  return i;
+#endif
+}
+
+// Returns the end of the value at i. Containers are skipped by counting brackets outside strings,
+// without looking at anything else in them.
+static uint8_t* skip_value(uint8_t* i, uint8_t* end) {
+  size_t depth = 0;
+  if (*i != '"' && *i != '[' && *i != '{') {
+    while (*i > ' ' && *i != ',' && *i != ']' && *i != '}') {
+      ++i;
+    }
+    return i;
+  }
+  for (;;) {
+    switch (*i) {
+      case '"':
+        if ((i = find_string_end(i + 1, end)) == end) {
+          return end;
+        }
+        ++i;
+        break;
+      case '[':
+      case '{':
+        ++depth;
+        ++i;
+        break;
+      case ']':
+      case '}':
+        --depth;
+        ++i;
+        break;
+      default:
+        if (i >= end) {
+          return end;
+        }
+        ++i;
+    }
+    if (!depth) {
+      return i;
+    }
+    i = find_structural(i);
+  }
+}
+
+// Decodes the escape starting at *i into UTF-8, moves *i past it and returns the number of bytes
+// written. Invalid escapes decode to nothing.
+static size_t decode_escape(const uint8_t** i, uint8_t decoded[4]) {
+  const uint8_t* escape = *i;
+  uint64_t value;
+  uint64_t low;
+  *i += 2;
+  switch (escape[1]) {
+    case 'b':
+      decoded[0] = '\b';
+      return 1;
+    case 'f':
+      decoded[0] = '\f';
+      return 1;
+    case 'n':
+      decoded[0] = '\n';
+      return 1;
+    case 'r':
+      decoded[0] = '\r';
+      return 1;
+    case 't':
+      decoded[0] = '\t';
+      return 1;
+    case 'u':
+      if ((value = hex_value(escape + 2)) == INT64_MAX) {
+        return 0;
+      }
+      *i += 4;
+      if (value >= 0xD800 && value < 0xDC00 && escape[6] == '\\' && escape[7] == 'u' &&
+          (low = hex_value(escape + 8)) >= 0xDC00 && low < 0xE000) {
+        value = 0x10000 + ((value - 0xD800) << 10) + (low - 0xDC00);
+        *i += 6;
+      }
+      if (value < 0x80) {
+        decoded[0] = value;
+        return 1;
+      } else if (value < 0x800) {
+        decoded[0] = 0xC0 | value >> 6;
+        decoded[1] = 0x80 | (value & 0x3F);
+        return 2;
+      } else if (value < 0x10000) {
+        decoded[0] = 0xE0 | value >> 12;
+        decoded[1] = 0x80 | ((value >> 6) & 0x3F);
+        decoded[2] = 0x80 | (value & 0x3F);
+        return 3;
+      }
+      decoded[0] = 0xF0 | value >> 18;
+      decoded[1] = 0x80 | ((value >> 12) & 0x3F);
+      decoded[2] = 0x80 | ((value >> 6) & 0x3F);
+      decoded[3] = 0x80 | (value & 0x3F);
+      return 4;
+    default: // '"', '\\' and '/'
+      decoded[0] = escape[1];
+      return 1;
+  }
+}
+
+// Compares a member name as written, escapes included, with an unescaped pointer token
+static int key_equals(const uint8_t* i, const uint8_t* end, const char* token, size_t length) {
+  const char* token_end = token + length;
+  uint8_t decoded[4];
+  size_t count;
+  while (i < end) {
+    if (*i == '\\') {
+      count = decode_escape(&i, decoded);
+    } else {
+      decoded[0] = *i++;
+      count = 1;
+    }
+    if ((size_t) (token_end - token) < count || memcmp(token, decoded, count)) {
+      return 0;
+    }
+    token += count;
+  }
+  return token == token_end;
+}
+
+// hash_bytes of a member name with its escapes decoded, so that it equals the hash of a pointer token
+static uint64_t key_hash(const uint8_t* i, const uint8_t* end) {
+  uint64_t hash = 0xCBF29CE484222325ULL;
+  uint8_t decoded[4];
+  size_t count;
+  while (i < end) {
+    if (*i == '\\') {
+      count = decode_escape(&i, decoded);
+    } else {
+      decoded[0] = *i++;
+      count = 1;
+    }
+    for (size_t j = 0; j < count; ++j) {
+      hash = (hash ^ decoded[j]) * 0x100000001B3ULL;
+    }
+  }
+  return hash;
+}
+
+// Returns the value of the member named token in the object at i, or NULL
+static uint8_t* find_member(uint8_t* i, uint8_t* end, const char* token, size_t length) {
+  uint8_t* key;
+  int match;
+  for (i = skip_space(i + 1); *i == '"'; i = skip_space(i + 1)) {
+    key = i + 1;
+    if ((i = find_string_end(key, end)) == end) {
+      return NULL;
+    }
+    match = key_equals(key, i, token, length);
+    if (*(i = skip_space(i + 1)) != ':') {
+      return NULL;
+    }
+    i = skip_space(i + 1);
+    if (match) {
+      return i;
+    }
+    if (*(i = skip_space(skip_value(i, end))) != ',') {
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+// Returns element index of the array at i, or NULL
+static uint8_t* find_element(uint8_t* i, uint8_t* end, uint64_t index) {
+  for (i = skip_space(i + 1); *i && *i != ']'; i = skip_space(i + 1)) {
+    if (!index--) {
+      return i;
+    }
+    if (*(i = skip_space(skip_value(i, end))) != ',') {
+      return NULL;
+    }
+  }
+  return NULL;
+}
+
+// Appends length bytes to the template's bytes and returns their offset
+static size_t add_bytes(Template* template, const void* data, size_t length) {
+  const size_t offset = template->bytes_length;
+  if (offset + length > template->bytes_size) {
+    template->bytes_size = (offset + length) * 2;
+    template->bytes = realloc(template->bytes, template->bytes_size + 16);
+  }
+  memcpy(template->bytes + offset, data, length);
+  template->bytes_length += length;
+  return offset;
+}
+
+// Reads the member names of the object at i into template, in order. In a schema's properties each
+// value is a subschema whose "type" gives the kind. Otherwise i is a line whose values give the kinds,
+// and the bytes around them are kept as its layout.
+static int read_template(Template* template, uint8_t* i, uint8_t* end, int schema) {
+  uint8_t* previous = i; // end of the previous value
+  uint8_t* name;
+  uint8_t* value;
+  Field* field;
+  template->count = template->bytes_length = template->tail_length = 0;
+  if (*(i = skip_space(i)) != '{') {
+    return -1;
+  }
+  for (i = skip_space(i + 1); *i == '"';) {
+    name = i;
+    if ((i = find_string_end(name + 1, end)) == end || *(value = skip_space(i + 1)) != ':') {
+      return -1;
+    }
+    if (template->count == template->size) {
+      template->size = template->size ? template->size * 2 : 16;
+      template->fields = realloc(template->fields, template->size * sizeof(Field));
+    }
+    field = &template->fields[template->count++];
+    field->length = i + 1 - name;
+    field->name = add_bytes(template, name, field->length);
+    field->escaped = memchr(name, '\\', field->length) != NULL;
+    field->layout_length = 0;
+    value = skip_space(value + 1);
+    if (!schema && !field->escaped) {
+      field->layout_length = value - previous;
+      field->layout = add_bytes(template, previous, field->layout_length);
+      field->minified = add_bytes(template, template->count > 1 ? "," : "{", 1);
+      add_bytes(template, name, field->length);
+      add_bytes(template, ":", 1);
+      field->minified_length = field->length + 2;
+    }
+    previous = i = skip_value(value, end);
+    if (schema) {
+      value = *value == '{' ? find_member(value, end, "type", 4) : NULL;
+      field->kind = !value ? AnyValue
+                    : !memcmp(value, "\"string\"", 8) ? StringValue
+                    : !memcmp(value, "\"number\"", 8) || !memcmp(value, "\"integer\"", 9) ? NumberValue : AnyValue;
+    } else {
+      field->kind = *value == '"' ? StringValue : *value == '-' || (*value >= '0' && *value <= '9') ? NumberValue : AnyValue;
+    }
+    if (*(i = skip_space(i)) != ',') {
+      break;
+    }
+    if (*(i = skip_space(i + 1)) != '"') {
+      return -1;
+    }
+  }
+  if (*i != '}') {
+    return -1;
+  }
+  if (!schema && template->count && skip_space(i + 1) >= end) {
+    template->tail_length = end - previous;
+    template->tail = add_bytes(template, previous, template->tail_length);
+  }
+  return 0;
+}
+
+// Reads the properties of a JSON Schema file into schema
+static int load_schema(void) {
+  struct stat sb;
+  uint8_t* data;
+  uint8_t* properties;
+  int result = -1;
+  int fd = open(schema_path, O_RDONLY);
+  if (fd < 0 || fstat(fd, &sb) < 0) {
+    return -1;
+  }
+  data = map_padded(fd, sb.st_size, MAP_PRIVATE);
+  close(fd);
+  if (data == MAP_FAILED) {
+    return -1;
+  }
+  properties = skip_space(data);
+  if (*properties == '{' && (properties = find_member(properties, data + sb.st_size, "properties", 10))) {
+    result = read_template(&schema, properties, data + sb.st_size, 1);
+  }
+  schema.valid = result == 0;
+  munmap(data, padded_size(sb.st_size));
+  return result;
+}
+
+// Parses an array index token: decimal digits without leading zeros. Returns -1 otherwise.
+static int parse_index(const char* token, size_t length, uint64_t* index) {
+  *index = 0;
+  if (!length || (length > 1 && *token == '0')) {
+    return -1;
+  }
+  for (size_t j = 0; j < length; ++j) {
+    if (token[j] < '0' || token[j] > '9' || *index > (UINT64_MAX - 9) / 10) {
+      return -1;
+    }
+    *index = *index * 10 + (token[j] - '0');
+  }
+  return 0;
+}
+
+// Unescapes the reference token after the '/' at pointer into token and returns the rest of the pointer
+static const char* next_token(const char* pointer, char* token, size_t* length) {
+  for (++pointer, *length = 0; *pointer && *pointer != '/'; ++pointer) {
+    if (*pointer == '~' && (pointer[1] == '0' || pointer[1] == '1')) {
+      token[(*length)++] = *++pointer == '0' ? '~' : '/';
+    } else {
+      token[(*length)++] = *pointer;
+    }
+  }
+  return pointer;
+}
+
+// Follows a JSON Pointer (RFC 6901) from the value at i and returns the start of its target, or NULL.
+// token needs room for the longest reference token.
+static uint8_t* resolve_pointer(uint8_t* i, uint8_t* end, const char* pointer, char* token) {
+  size_t length;
+  uint64_t index;
+  i = skip_space(i);
+  while (*pointer == '/') {
+    pointer = next_token(pointer, token, &length);
+    if (*i == '{') {
+      i = find_member(i, end, token, length);
+    } else if (*i == '[' && parse_index(token, length, &index) == 0) {
+      i = find_element(i, end, index);
+    } else {
+      return NULL;
+    }
+    if (!i) {
+      return NULL;
+    }
+  }
+  return *pointer || i >= end ? NULL : i;
+}
+
+// Minifies the value at pointer in range and writes it to stdout on its own line. The range must be
+// followed by padding, and is modified.
+static int get_value(uint8_t* start, uint8_t* end, const char* pointer, char* token) {
+  uint8_t* value;
+  uint8_t* value_end;
+  size_t length;
+  unsigned kernels;
+  *end = 0;
+  if (!(value = resolve_pointer(start, end, pointer, token))) {
+    return -1;
+  }
+  value_end = skip_value(value, end);
+  length = minify_range(value, value_end - value, &options, &kernels);
+  fwrite(value, 1, length, stdout);
+  putchar('\n');
+  return 0;
+}
+
+// Prints the value at pointer without minifying the file. The file is mapped privately, so scanning
+// can stop as soon as the value is found and pages past it are never read. With -n, prints the value
+// in each line, or an empty line where it is missing.
+static int do_get(char filename[], const char* pointer) {
+  uint8_t* data;
+  uint8_t* line;
+  uint8_t* line_end;
+  uint8_t* data_end;
+  char* token;
+  struct stat sb;
+  int exit_code = EXIT_SUCCESS;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0 || fstat(fd, &sb) < 0) {
+    fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return EXIT_FAILURE;
+  }
+  data = map_padded(fd, sb.st_size, MAP_PRIVATE);
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Could not map %s: %s\n", filename, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  token = malloc(strlen(pointer) + 1);
+  data_end = data + sb.st_size;
+  if (!options.ndjson) {
+    if (get_value(data, data_end, pointer, token) < 0) {
+      fprintf(stderr, "%s: %s not found\n", filename, pointer);
+      exit_code = EXIT_FAILURE;
+    }
+  } else {
+    for (line = data; line < data_end; line = line_end + 1) {
+      if (!(line_end = memchr(line, '\n', data_end - line))) {
+        line_end = data_end;
+      }
+      if (skip_space(line) >= line_end && options.ndjson == 1) {
+        continue;
+      }
+      if (get_value(line, line_end, pointer, token) < 0) {
+        putchar('\n');
+      }
+    }
+  }
+  free(token);
+  munmap(data, padded_size(sb.st_size));
+  return exit_code;
+}
+
+// Makes room for length more bytes and the padding minify_range needs after them
+static uint8_t* reserve_column(ColumnChunk* chunk, size_t column, size_t length) {
+  if (chunk->lengths[column] + length + LJSON_PADDING > chunk->sizes[column]) {
+    chunk->sizes[column] = (chunk->lengths[column] + length + LJSON_PADDING) * 2;
+    chunk->buffers[column] = realloc(chunk->buffers[column], chunk->sizes[column]);
+  }
+  return chunk->buffers[column] + chunk->lengths[column];
+}
+
+// Appends each column's value in every line of the chunk, minified with the other options
+static void* extract_columns(void* arg) {
+  ColumnChunk* chunk = arg;
+  uint8_t* line;
+  uint8_t* line_end;
+  uint8_t** values = malloc(column_count * sizeof(uint8_t*));
+  uint8_t* output;
+  char* token;
+  size_t token_size = 1;
+  size_t length;
+  unsigned kernels;
+  double number;
+  for (size_t c = 0; c < column_count; ++c) {
+    token_size += strlen(columns[c].pointer);
+  }
+  token = malloc(token_size);
+  for (line = chunk->start; line < chunk->end; line = line_end + 1) {
+    if (!(line_end = memchr(line, '\n', chunk->end - line))) {
+      line_end = chunk->end;
+    }
+    *line_end = 0;
+    if (skip_space(line) >= line_end && options.ndjson == 1) {
+      continue;
+    }
+    // Find every value before minifying any, since minifying in place would disturb the line
+    for (size_t c = 0; c < column_count; ++c) {
+      values[c] = resolve_pointer(line, line_end, columns[c].pointer, token);
+    }
+    for (size_t c = 0; c < column_count; ++c) {
+      length = values[c] ? (size_t) (skip_value(values[c], line_end) - values[c]) : 0;
+      output = reserve_column(chunk, c, length + sizeof(double));
+      if (length) {
+        memcpy(output, values[c], length);
+        length = minify_range(output, length, &options, &kernels);
+      }
+      if (columns[c].binary) {
+        number = NAN;
+        if (length && (*output == '-' || (*output >= '0' && *output <= '9'))) {
+          output[length] = 0;
+          number = strtod((char*) output, NULL);
+        }
+        memcpy(output, &number, sizeof(double));
+        chunk->lengths[c] += sizeof(double);
+      } else {
+        output[length] = '\n';
+        chunk->lengths[c] += length + 1;
+      }
+    }
+  }
+  free(token);
+  free(values);
+  return NULL;
+}
+
+// Writes the value at each column's pointer in every line to the column's file, without changing
+// the file. Each round cuts COLUMN_CHUNK bytes per processor at newlines and extracts them in parallel.
+static int do_columns(char filename[]) {
+  uint8_t* data;
+  uint8_t* data_end;
+  uint8_t* start;
+  ColumnChunk* chunks;
+  size_t thread_count = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+  size_t chunk_count;
+  struct stat sb;
+  uint64_t started = metrics_path ? monotonic_ns() : 0;
+  uint64_t bytes_out = 0;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0 || fstat(fd, &sb) < 0) {
+    fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    if (metrics_path) {
+      record_metrics(0, 0, started, 1);
+    }
+    return EXIT_FAILURE;
+  }
+  data = map_padded(fd, sb.st_size, MAP_PRIVATE);
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Could not map %s: %s\n", filename, strerror(errno));
+    if (metrics_path) {
+      record_metrics(0, 0, started, 1);
+    }
+    return EXIT_FAILURE;
+  }
+  data_end = data + sb.st_size;
+  chunks = calloc(thread_count, sizeof(ColumnChunk));
+  for (size_t t = 0; t < thread_count; ++t) {
+    chunks[t].buffers = calloc(column_count, sizeof(uint8_t*));
+    chunks[t].lengths = calloc(column_count, sizeof(size_t));
+    chunks[t].sizes = calloc(column_count, sizeof(size_t));
+  }
+  for (start = data; start < data_end;) {
+    for (chunk_count = 0; chunk_count < thread_count && start < data_end; ++chunk_count) {
+      ColumnChunk* chunk = &chunks[chunk_count];
+      chunk->start = start;
+      if ((size_t) (data_end - start) > COLUMN_CHUNK && (chunk->end = memchr(start + COLUMN_CHUNK, '\n', data_end - start - COLUMN_CHUNK))) {
+        ++(chunk->end);
+      } else {
+        chunk->end = data_end;
+      }
+      memset(chunk->lengths, 0, column_count * sizeof(size_t));
+      chunk->started = chunk_count && pthread_create(&chunk->thread, NULL, extract_columns, chunk) == 0;
+      start = chunk->end;
+    }
+    for (size_t t = 0; t < chunk_count; ++t) {
+      if (chunks[t].started) {
+        pthread_join(chunks[t].thread, NULL);
+      } else {
+        extract_columns(&chunks[t]);
+      }
+      for (size_t c = 0; c < column_count; ++c) {
+        fwrite(chunks[t].buffers[c], 1, chunks[t].lengths[c], columns[c].stream);
+        bytes_out += chunks[t].lengths[c];
+      }
+    }
+  }
+  for (size_t t = 0; t < thread_count; ++t) {
+    for (size_t c = 0; c < column_count; ++c) {
+      free(chunks[t].buffers[c]);
+    }
+    free(chunks[t].buffers);
+    free(chunks[t].lengths);
+    free(chunks[t].sizes);
+  }
+  free(chunks);
+  munmap(data, padded_size(sb.st_size));
+  if (metrics_path) {
+    record_metrics(sb.st_size, bytes_out, started, 0);
+  }
+  return EXIT_SUCCESS;
+}
+
+// Parses --columns: comma-separated JSON Pointers, each optionally followed by :f64, and opens a file
+// per column in output_dir named after the pointer's tokens joined with dots
+static int open_columns(char list[]) {
+  char* path;
+  char* name;
+  char* suffix;
+  for (char* item = strtok(list, ","); item; item = strtok(NULL, ",")) {
+    columns = realloc(columns, (column_count + 1) * sizeof(Column));
+    Column* column = &columns[column_count++];
+    column->pointer = item;
+    column->binary = 0;
+    column->stream = NULL;
+    if ((suffix = strrchr(item, ':')) && !strcmp(suffix, ":f64")) {
+      *suffix = 0;
+      column->binary = 1;
+    }
+    if (*item != '/') {
+      fprintf(stderr, "Column %s must be a JSON Pointer starting with /\n", item);
+      return EXIT_FAILURE;
+    }
+    path = malloc(strlen(output_dir) + strlen(item) + 16);
+    name = path + sprintf(path, "%s/", output_dir);
+    sprintf(name, "%s%s", item + 1, column->binary ? ".f64" : ".ndjson");
+    for (; *name; ++name) {
+      if (*name == '/') {
+        *name = '.';
+      }
+    }
+    if (!(column->stream = fopen(path, "w"))) {
+      fprintf(stderr, "Could not create %s: %s\n", path, strerror(errno));
+      free(path);
+      return EXIT_FAILURE;
+    }
+    free(path);
+  }
+  return EXIT_SUCCESS;
+}
+
+static int close_columns(void) {
+  int exit_code = EXIT_SUCCESS;
+  for (size_t c = 0; c < column_count; ++c) {
+    if (columns[c].stream && fclose(columns[c].stream) != 0) {
+      fprintf(stderr, "Could not write column %s: %s\n", columns[c].pointer, strerror(errno));
+      exit_code = EXIT_FAILURE;
+    }
+  }
+  return exit_code;
+}
+
+static int compare_entries(const void* a, const void* b) {
+  const IndexEntry* x = a;
+  const IndexEntry* y = b;
+  return x->hash != y->hash ? (x->hash < y->hash ? -1 : 1) : (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+static int compare_nodes(const void* a, const void* b) {
+  return (((const IndexNode*) a)->start > ((const IndexNode*) b)->start) - (((const IndexNode*) a)->start < ((const IndexNode*) b)->start);
+}
+
+static void add_entry(IndexEntry** entries, size_t* count, size_t* size, uint64_t hash, uint64_t offset) {
+  if (*count == *size) {
+    *size = *size ? *size * 2 : 1024;
+    *entries = realloc(*entries, *size * sizeof(IndexEntry));
+  }
+  (*entries)[(*count)++] = (IndexEntry) {hash, offset};
+}
+
+// Writes the index of the JSON in [data, end) to path. Entries are collected on a pending list while
+// their container is open, then moved to the final list in one block when it closes, or dropped if it
+// turned out too small to index.
+static int write_index(const char path[], uint8_t* data, uint8_t* end) {
+  const uint8_t end_byte = *end;
+  IndexHeader header = {{'L', 'J', 'I', 'X'}, INDEX_VERSION, end - data, hash_tail(data, end - data)};
+  IndexNode* nodes = NULL;
+  IndexEntry* entries = NULL;
+  IndexEntry* pending = NULL;
+  IndexLevel* levels = NULL;
+  IndexLevel* level = NULL; // innermost open container
+  size_t node_size = 0;
+  size_t entry_size = 0;
+  size_t pending_count = 0;
+  size_t pending_size = 0;
+  size_t depth = 0;
+  size_t level_size = 0;
+  int in_object = 0;
+  int expect_key = 0;
+  uint8_t* i = data;
+  uint8_t* j;
+  char* temp_path = malloc(strlen(path) + 5);
+  FILE* stream;
+  int exit_code = EXIT_SUCCESS;
+  *end = 0;
+  while (*i || i < end) {
+    if (level && !in_object && (*i == '{' || *i == '[' || *i == '"' || (*i > ' ' && *i != ',' && *i != ']' && *i != '}'))) {
+      if (level->count++ % INDEX_STRIDE == 0) { // an element starts here
+        add_entry(&pending, &pending_count, &pending_size, 0, i - data);
+      }
+    }
+    switch (*i) {
+      case '{':
+      case '[':
+        if (depth == level_size) {
+          level_size = level_size ? level_size * 2 : 64;
+          levels = realloc(levels, level_size * sizeof(IndexLevel));
+        }
+        level = &levels[depth++];
+        *level = (IndexLevel) {i - data, 0, pending_count};
+        in_object = expect_key = *i++ == '{';
+        break;
+      case '}':
+      case ']':
+        if (!depth) {
+          ++i;
+          break;
+        }
+        if ((uint64_t) (i + 1 - data) - level->start >= INDEX_SPAN) {
+          if (header.node_count == node_size) {
+            node_size = node_size ? node_size * 2 : 1024;
+            nodes = realloc(nodes, node_size * sizeof(IndexNode));
+          }
+          nodes[header.node_count++] = (IndexNode) {level->start, i + 1 - data, header.entry_count, level->count};
+          if (data[level->start] == '{') {
+            qsort(pending + level->pending, pending_count - level->pending, sizeof(IndexEntry), compare_entries);
+          }
+          for (size_t k = level->pending; k < pending_count; ++k) {
+            add_entry(&entries, &header.entry_count, &entry_size, pending[k].hash, pending[k].offset);
+          }
+        }
+        pending_count = level->pending;
+        level = --depth ? &levels[depth - 1] : NULL;
+        in_object = level && data[level->start] == '{';
+        expect_key = 0;
+        ++i;
+        break;
+      case '"':
+        j = find_string_end(i + 1, end);
+        if (in_object && expect_key) {
+          add_entry(&pending, &pending_count, &pending_size, key_hash(i + 1, j), i - data);
+          ++(level->count);
+        }
+        expect_key = 0;
+        i = j < end ? j + 1 : end;
+        break;
+      case ',':
+        expect_key = in_object;
+        ++i;
+        break;
+      case ':':
+      case ' ':
+      case '\t':
+      case '\n':
+      case '\r':
+        ++i;
+        break;
+      default:
+        j = skip_value(i, end);
+        i = j > i ? j : i + 1;
+    }
+  }
+  *end = end_byte;
+  // The arrays stay NULL in a file without long containers, which qsort and fwrite must not be given
+  if (header.node_count) {
+    qsort(nodes, header.node_count, sizeof(IndexNode), compare_nodes); // they were added as they closed
+  }
+  sprintf(temp_path, "%s.tmp", path);
+  if (!(stream = fopen(temp_path, "w")) || fwrite(&header, sizeof(header), 1, stream) != 1 ||
+      (header.node_count && fwrite(nodes, sizeof(IndexNode), header.node_count, stream) != header.node_count) ||
+      (header.entry_count && fwrite(entries, sizeof(IndexEntry), header.entry_count, stream) != header.entry_count) ||
+      fclose(stream) != 0 || rename(temp_path, path) < 0) {
+    fprintf(stderr, "Could not write %s: %s\n", path, strerror(errno));
+    exit_code = EXIT_FAILURE;
+  }
+  free(temp_path);
+  free(nodes);
+  free(entries);
+  free(pending);
+  free(levels);
+  return exit_code;
+}
+
+typedef struct Index {
+  uint8_t* data;
+  uint8_t* end;
+  const IndexNode* nodes;
+  const IndexEntry* entries;
+  uint64_t node_count;
+  uint64_t entry_count;
+} Index;
+
+// Returns the node of the container at value, or NULL if it was too small to index or the node is
+// inconsistent with the entries
+static const IndexNode* find_node(const Index* index, const uint8_t* value) {
+  const uint64_t start = value - index->data;
+  const IndexNode* node;
+  uint64_t entry_count;
+  size_t low = 0;
+  size_t high = index->node_count;
+  while (low < high) {
+    const size_t middle = low + (high - low) / 2;
+    if (index->nodes[middle].start < start) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  if (low == index->node_count || (node = &index->nodes[low])->start != start) {
+    return NULL;
+  }
+  entry_count = *value == '{' ? node->count : node->count / INDEX_STRIDE + (node->count % INDEX_STRIDE != 0);
+  if (node->end > (uint64_t) (index->end - index->data) || node->first > index->entry_count ||
+      entry_count > index->entry_count - node->first) {
+    return NULL;
+  }
+  return node;
+}
+
+static uint8_t* skip_indexed(const Index* index, uint8_t* value) {
+  const IndexNode* node = find_node(index, value);
+  return node ? index->data + node->end : skip_value(value, index->end);
+}
+
+// Returns the start of an entry's member name or element, or NULL if it lies outside the file
+static uint8_t* entry_start(const Index* index, const IndexEntry* entry) {
+  return entry->offset < (uint64_t) (index->end - index->data) ? index->data + entry->offset : NULL;
+}
+
+// Returns element n of the array at i: from the entry at or before it, skipping at most
+// INDEX_STRIDE - 1 elements, or by scanning an array too small to index
+static uint8_t* index_element(const Index* index, uint8_t* i, uint64_t n) {
+  const IndexNode* node = find_node(index, i);
+  if (!node) {
+    return find_element(i, index->end, n);
+  }
+  if (n >= node->count || !(i = entry_start(index, &index->entries[node->first + n / INDEX_STRIDE]))) {
+    return NULL;
+  }
+  for (n %= INDEX_STRIDE; n; --n) {
+    if (*(i = skip_space(skip_indexed(index, i))) != ',') {
+      return NULL;
+    }
+    i = skip_space(i + 1);
+  }
+  return i;
+}
+
+static uint64_t element_count(const Index* index, uint8_t* i) {
+  const IndexNode* node = find_node(index, i);
+  uint64_t count = 0;
+  if (node) {
+    return node->count;
+  }
+  for (i = skip_space(i + 1); *i && *i != ']'; i = skip_space(i + 1)) {
+    ++count;
+    if (*(i = skip_space(skip_value(i, index->end))) != ',') {
+      break;
+    }
+  }
+  return count;
+}
+
+// Returns the value of the member named token in the object at i
+static uint8_t* index_member(const Index* index, uint8_t* i, const char* token, size_t length) {
+  const IndexNode* node = find_node(index, i);
+  const uint64_t hash = hash_bytes((const uint8_t*) token, length);
+  const IndexEntry* entries;
+  uint8_t* key_end;
+  size_t low = 0;
+  size_t high;
+  if (!node) {
+    return find_member(i, index->end, token, length);
+  }
+  entries = index->entries + node->first;
+  for (high = node->count; low < high;) {
+    const size_t middle = low + (high - low) / 2;
+    if (entries[middle].hash < hash) {
+      low = middle + 1;
+    } else {
+      high = middle;
+    }
+  }
+  for (; low < node->count && entries[low].hash == hash; ++low) {
+    if ((i = entry_start(index, &entries[low])) && *i == '"') {
+      key_end = find_string_end(i + 1, index->end);
+      if (key_equals(i + 1, key_end, token, length) && *(i = skip_space(key_end + 1)) == ':') {
+        return skip_space(i + 1);
+      }
+    }
+  }
+  return NULL;
+}
+
+// Parses a START:END slice token. Either bound may be empty or negative, counting from the end.
+static int parse_slice(const char* token, size_t length, uint64_t count, uint64_t* from, uint64_t* to) {
+  const char* colon = memchr(token, ':', length);
+  const char* part[2] = {token, colon + 1};
+  const size_t part_length[2] = {colon - token, token + length - colon - 1};
+  int64_t bounds[2] = {0, count};
+  for (int k = 0; k < 2; ++k) {
+    const char* c = part[k];
+    const int negative = part_length[k] && *c == '-';
+    int64_t value = 0;
+    if (!part_length[k]) {
+      continue;
+    }
+    if (part_length[k] == (size_t) negative) {
+      return -1;
+    }
+    for (c += negative; c < part[k] + part_length[k]; ++c) {
+      if (*c < '0' || *c > '9' || value > (INT64_MAX - 9) / 10) {
+        return -1;
+      }
+      value = value * 10 + (*c - '0');
+    }
+    value = negative ? (int64_t) count - value : value;
+    bounds[k] = value < 0 ? 0 : value > (int64_t) count ? (int64_t) count : value;
+  }
+  *from = bounds[0];
+  *to = bounds[1] > bounds[0] ? bounds[1] : bounds[0];
+  return 0;
+}
+
+// Looks each reference token up in the index, so the cost depends on the depth of the pointer and
+// not on the size of the file. A last token of the form START:END on an array prints those elements
+// as an array.
+static int query_index(const Index* index, const char* pointer, char* token) {
+  uint8_t* value = skip_space(index->data);
+  uint8_t* last;
+  uint64_t from;
+  uint64_t to;
+  size_t length;
+  while (*pointer == '/') {
+    pointer = next_token(pointer, token, &length);
+    if (*value == '{') {
+      value = index_member(index, value, token, length);
+    } else if (*value == '[' && !*pointer && memchr(token, ':', length)) {
+      if (parse_slice(token, length, element_count(index, value), &from, &to) < 0) {
+        return -1;
+      }
+      putchar('[');
+      if (from < to && (last = index_element(index, value, to - 1)) && (value = index_element(index, value, from))) {
+        fwrite(value, 1, skip_indexed(index, last) - value, stdout);
+      }
+      puts("]");
+      return 0;
+    } else if (*value == '[' && parse_index(token, length, &from) == 0) {
+      value = index_element(index, value, from);
+    } else {
+      return -1;
+    }
+    if (!value || value >= index->end) {
+      return -1;
+    }
+  }
+  if (*pointer || value >= index->end) {
+    return -1;
+  }
+  fwrite(value, 1, skip_indexed(index, value) - value, stdout);
+  putchar('\n');
+  return 0;
+}
+
+// Prints the value at pointer using the sidecar written by --build-index. The value is printed as
+// stored, which is minified when the index was built by lighterjson.
+static int do_query(char filename[], const char* pointer) {
+  char* index_path = malloc(strlen(filename) + 5);
+  const IndexHeader* header = MAP_FAILED;
+  struct stat sb;
+  struct stat index_sb = {0};
+  Index index = {MAP_FAILED};
+  char* token = NULL;
+  int exit_code = EXIT_FAILURE;
+  int fd = open(filename, O_RDONLY);
+  int index_fd = -1;
+  sprintf(index_path, "%s.idx", filename);
+  if (fd < 0 || fstat(fd, &sb) < 0) {
+    fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+    goto close_and_return;
+  }
+  if ((index_fd = open(index_path, O_RDONLY)) < 0 || fstat(index_fd, &index_sb) < 0) {
+    fprintf(stderr, "Could not open %s: %s. Build it with --build-index\n", index_path, strerror(errno));
+    goto close_and_return;
+  }
+  if ((size_t) index_sb.st_size < sizeof(IndexHeader) ||
+      (header = mmap(NULL, index_sb.st_size, PROT_READ, MAP_PRIVATE, index_fd, 0)) == MAP_FAILED ||
+      (index.data = map_padded(fd, sb.st_size, MAP_PRIVATE)) == MAP_FAILED) {
+    fprintf(stderr, "Could not map %s\n", header == MAP_FAILED ? index_path : filename);
+    goto close_and_return;
+  }
+  index.end = index.data + sb.st_size;
+  index.node_count = header->node_count;
+  index.entry_count = header->entry_count;
+  if (memcmp(header->magic, "LJIX", 4) || header->version != INDEX_VERSION ||
+      header->node_count > (index_sb.st_size - sizeof(IndexHeader)) / sizeof(IndexNode) ||
+      header->entry_count != (index_sb.st_size - sizeof(IndexHeader) - header->node_count * sizeof(IndexNode)) / sizeof(IndexEntry)) {
+    fprintf(stderr, "%s is not a lighterjson index\n", index_path);
+    goto close_and_return;
+  }
+  if (header->size != (uint64_t) sb.st_size || header->fingerprint != hash_tail(index.data, sb.st_size)) {
+    fprintf(stderr, "%s is out of date. Rebuild it with --build-index\n", index_path);
+    goto close_and_return;
+  }
+  index.nodes = (const IndexNode*) (header + 1);
+  index.entries = (const IndexEntry*) (index.nodes + index.node_count);
+  token = malloc(strlen(pointer) + 1);
+  *index.end = 0;
+  if (query_index(&index, pointer, token) < 0) {
+    fprintf(stderr, "%s: %s not found\n", filename, pointer);
+  } else {
+    exit_code = EXIT_SUCCESS;
+  }
+
+  close_and_return:
+  if (index.data != MAP_FAILED) {
+    munmap(index.data, padded_size(sb.st_size));
+  }
+  if (header != MAP_FAILED) {
+    munmap((void*) header, index_sb.st_size);
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  if (index_fd >= 0) {
+    close(index_fd);
+  }
+  free(token);
+  free(index_path);
+  return exit_code;
+}
+
+// Each message, in both directions, is a 4-byte big-endian length followed by that many bytes
+static int read_full(int fd, void* data, size_t length) {
+  ssize_t count;
+  for (uint8_t* i = data; length; i += count, length -= count) {
+    if ((count = read(fd, i, length)) <= 0) {
+      if (count < 0 && errno == EINTR) {
+        count = 0;
+        continue;
+      }
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int write_full(int fd, const void* data, size_t length) {
+  ssize_t count;
+  for (const uint8_t* i = data; length; i += count, length -= count) {
+    if ((count = write(fd, i, length)) < 0) {
+      if (errno == EINTR) {
+        count = 0;
+        continue;
+      }
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Writes the oldest files in flight to the bundle until at most keep remain
+static int flush_bundle(size_t keep) {
+  Pending* entry;
+  size_t length;
+  unsigned kernels;
+  char kernel_text[64];
+  int exit_code = EXIT_SUCCESS;
+  for (; bundle.count > keep; bundle.head = (bundle.head + 1) % bundle.capacity, --bundle.count) {
+    entry = &bundle.entries[bundle.head];
+    wait_job(entry->job, &length, &kernels);
+    entry->data[length] = '\n';
+    if (bundle.failed) {
+      exit_code = EXIT_FAILURE;
+    } else if (memchr(entry->data, '\n', length)) { // such as NDJSON with -n, which would not read back as one file
+      fprintf(stderr, "Could not bundle %s: it does not minify to a single line\n", entry->path);
+      exit_code = EXIT_FAILURE;
+    } else if (write_full(bundle.fd, entry->data, length + 1) < 0) {
+      fprintf(stderr, "Could not write %s: %s\n", bundle.temp_path, strerror(errno));
+      bundle.failed = 1;
+      exit_code = EXIT_FAILURE;
+    } else {
+      write_escaped_path(bundle.index, entry->path);
+      fprintf(bundle.index, "\t%" PRIu64 "\t%lu\n", bundle.offset, (unsigned long) length);
+      bundle.offset += length + 1;
+      if (ferror(bundle.index)) {
+        fprintf(stderr, "Could not write %s: %s\n", bundle.temp_index_path, strerror(errno));
+        bundle.failed = 1;
+        exit_code = EXIT_FAILURE;
+      } else if (!quiet) {
+        printf("%s: Saved %lu bytes%s\n", entry->path, (unsigned long) (entry->length - length),
+               describe_kernels(kernels, kernel_text));
+      }
+    }
+    if (metrics_path) {
+      record_metrics(entry->length, length, entry->started, exit_code != EXIT_SUCCESS);
+    }
+    free(entry->path);
+    free(entry->data);
+  }
+  return exit_code;
+}
+
+// Reads a file and queues it for minification into the bundle, writing older ones first if the
+// pool is full
+static int bundle_file(char filename[]) {
+  Pending* entry;
+  struct stat sb;
+  int fd;
+  if (flush_bundle(bundle.capacity - 1) != EXIT_SUCCESS) {
+    return EXIT_FAILURE;
+  }
+  if ((fd = open(filename, O_RDONLY)) < 0 || fstat(fd, &sb) < 0) {
+    fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    return EXIT_FAILURE;
+  }
+  entry = &bundle.entries[(bundle.head + bundle.count) % bundle.capacity];
+  entry->started = metrics_path ? monotonic_ns() : 0;
+  entry->length = sb.st_size;
+  if (!(entry->data = malloc(entry->length + LJSON_PADDING)) || read_full(fd, entry->data, entry->length) < 0) {
+    fprintf(stderr, "Could not read %s: %s\n", filename, strerror(errno));
+    free(entry->data);
+    close(fd);
+    return EXIT_FAILURE;
+  }
+  close(fd);
+  if (!(entry->job = ljson_submit(bundle.pool, entry->data, entry->length, &options, NULL, NULL))) {
+    fprintf(stderr, "Could not queue %s: %s\n", filename, strerror(errno));
+    free(entry->data);
+    return EXIT_FAILURE;
+  }
+  entry->path = strdup(filename);
+  ++bundle.count;
+  return EXIT_SUCCESS;
+}
+
+static int open_bundle(void) {
+  const size_t threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+  bundle.capacity = threads * 4;
+  bundle.entries = malloc(bundle.capacity * sizeof(Pending));
+  bundle.temp_path = malloc(strlen(bundle_path) + 5);
+  bundle.index_path = malloc(strlen(bundle_path) + 7);
+  bundle.temp_index_path = malloc(strlen(bundle_path) + 11);
+  sprintf(bundle.temp_path, "%s.tmp", bundle_path);
+  sprintf(bundle.index_path, "%s.index", bundle_path);
+  sprintf(bundle.temp_index_path, "%s.index.tmp", bundle_path);
+  if ((bundle.fd = open(bundle.temp_path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0 ||
+      !(bundle.index = fopen(bundle.temp_index_path, "w"))) {
+    fprintf(stderr, "Could not create %s: %s\n", bundle.fd < 0 ? bundle.temp_path : bundle.temp_index_path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  if (!(bundle.pool = ljson_pool_create(threads, bundle.capacity))) {
+    fprintf(stderr, "Could not start threads\n");
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
+
+// Writes the files still in flight, then moves the bundle and its index into place if all went well
+static int close_bundle(int exit_code) {
+  if (flush_bundle(0) != EXIT_SUCCESS || bundle.failed) {
+    exit_code = EXIT_FAILURE;
+  }
+  ljson_pool_destroy(bundle.pool);
+  if (close(bundle.fd) < 0 || fclose(bundle.index) != 0) {
+    fprintf(stderr, "Could not write %s: %s\n", bundle_path, strerror(errno));
+    exit_code = EXIT_FAILURE;
+  }
+  if (exit_code == EXIT_SUCCESS && (rename(bundle.temp_path, bundle_path) < 0 || rename(bundle.temp_index_path, bundle.index_path) < 0)) {
+    fprintf(stderr, "Could not write %s: %s\n", bundle_path, strerror(errno));
+    exit_code = EXIT_FAILURE;
+  }
+  if (exit_code != EXIT_SUCCESS) {
+    unlink(bundle.temp_path);
+    unlink(bundle.temp_index_path);
+  }
+  free(bundle.entries);
+  free(bundle.temp_path);
+  free(bundle.index_path);
+  free(bundle.temp_index_path);
+  return exit_code;
+}
+
+// Closes the current part and creates the next
+static int open_part(Split* split) {
+  if (split->fd >= 0 && close(split->fd) < 0) {
+    fprintf(stderr, "Could not write %s: %s\n", split->path, strerror(errno));
+    return -1;
+  }
+  sprintf(split->number, "-%05lu%s", (unsigned long) split->part++, split->extension);
+  if ((split->fd = open(split->path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0) {
+    fprintf(stderr, "Could not create %s: %s\n", split->path, strerror(errno));
+    return -1;
+  }
+  split->written = 0;
+  return 0;
+}
+
+// Appends minified lines, starting a new part at the first newline at or past the limit
+static int write_split(Split* split, const uint8_t* data, size_t length) {
+  const uint8_t* cut;
+  size_t count;
+  while (length) {
+    if ((split->fd < 0 || split->written >= split->limit) && open_part(split) < 0) {
+      return -1;
+    }
+    count = length;
+    if (length > split->limit - split->written &&
+        (cut = memchr(data + (split->limit - split->written) - 1, '\n', length - (split->limit - split->written) + 1))) {
+      count = cut + 1 - data;
+    }
+    if (write_full(split->fd, data, count) < 0) {
+      fprintf(stderr, "Could not write %s: %s\n", split->path, strerror(errno));
+      return -1;
+    }
+    split->written += count;
+    data += count;
+    length -= count;
+  }
+  return 0;
+}
+
+// Waits for a buffer and appends it to the output. A failed write is only reported once, and later
+// buffers are then just released.
+static void write_pending(Pending* entry, Split* split, uint64_t* bytes_out) {
+  size_t length;
+  unsigned kernels;
+  wait_job(entry->job, &length, &kernels);
+  split->kernels |= kernels;
+  if (options.ndjson == 1 && length) {
+    entry->data[length++] = '\n'; // the pool drops the last newline of each buffer
+  }
+  if (!split->failed && write_split(split, entry->data, length) < 0) {
+    split->failed = 1;
+  }
+  *bytes_out += length;
+  free(entry->data);
+}
+
+// Writing thread of a stream, so that a slow output does not hold up reading
+static void* write_stream(void* arg) {
+  Stream* stream = arg;
+  pthread_mutex_lock(&stream->lock);
+  for (;;) {
+    while (!stream->count && !stream->done) {
+      pthread_cond_wait(&stream->changed, &stream->lock);
+    }
+    if (!stream->count) {
+      break;
+    }
+    pthread_mutex_unlock(&stream->lock);
+    write_pending(&stream->pending[stream->head], stream->split, &stream->bytes_out);
+    pthread_mutex_lock(&stream->lock);
+    stream->head = (stream->head + 1) % stream->capacity;
+    --stream->count;
+    pthread_cond_signal(&stream->changed);
+  }
+  pthread_mutex_unlock(&stream->lock);
+  return NULL;
+}
+
+// Minifies NDJSON from fd into split in three stages: this thread reads buffers cut at newlines, a
+// pool minifies them, and a writing thread appends the finished buffers in order. At most two buffers
+// per processor are in flight, so memory stays flat however long the input is.
+static int minify_stream(int fd, const char* name, Split* split, uint64_t* bytes_in, uint64_t* bytes_out) {
+  const size_t threads = sysconf(_SC_NPROCESSORS_ONLN) > 0 ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+  Stream stream = {.capacity = threads * 2, .split = split};
+  ljson_pool* pool = ljson_pool_create(threads, stream.capacity);
+  pthread_t writer;
+  Pending* entry;
+  uint8_t* buffer;
+  uint8_t* next;
+  uint8_t* line_end;
+  size_t size = SPLIT_CHUNK;
+  size_t filled = 0;
+  size_t length;
+  ssize_t read_length = 1;
+  struct pollfd pfd = {.fd = fd, .events = POLLIN};
+  int exit_code = EXIT_SUCCESS;
+  if (!pool) {
+    fprintf(stderr, "Could not start threads\n");
+    return EXIT_FAILURE;
+  }
+  stream.pending = malloc(stream.capacity * sizeof(Pending));
+  pthread_mutex_init(&stream.lock, NULL);
+  pthread_cond_init(&stream.changed, NULL);
+  if (pthread_create(&writer, NULL, write_stream, &stream) != 0) {
+    fprintf(stderr, "Could not start threads\n");
+    ljson_pool_destroy(pool);
+    free(stream.pending);
+    return EXIT_FAILURE;
+  }
+  buffer = malloc(size + LJSON_PADDING);
+  while (read_length && exit_code == EXIT_SUCCESS) {
+    if ((read_length = read(fd, buffer + filled, size - filled)) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "Could not read %s: %s\n", name, strerror(errno));
+      exit_code = EXIT_FAILURE;
+      break;
+    }
+    filled += read_length;
+    *bytes_in += read_length;
+    // Fill the buffer while the producer keeps up, but pass on the lines read so far once it has nothing
+    // more to give, so that a slow producer's lines are not held back until 8 MiB have arrived
+    if (read_length && filled < size && poll(&pfd, 1, 0) > 0) {
+      continue;
+    }
+    // Cut after the last newline, unless this is the end of the input
+    for (line_end = buffer + filled; read_length && line_end > buffer && line_end[-1] != '\n'; --line_end);
+    if (line_end == buffer && read_length && filled < size) {
+      continue; // the rest of the line is still on its way
+    }
+    if (line_end == buffer && read_length) {
+      size *= 2; // a line longer than the buffer
+      buffer = realloc(buffer, size + LJSON_PADDING);
+      continue;
+    }
+    length = line_end - buffer;
+    if (!read_length && length && buffer[length - 1] != '\n') {
+      buffer[length++] = '\n'; // so that the output ends with a newline like every part
+      ++filled;
+    }
+    next = malloc(size + LJSON_PADDING);
+    memcpy(next, line_end, filled - length); // before the pool may write past length
+    filled -= length;
+    if (length) {
+      pthread_mutex_lock(&stream.lock);
+      while (stream.count == stream.capacity) {
+        pthread_cond_wait(&stream.changed, &stream.lock);
+      }
+      if (split->failed) { // stop reading once the output fails
+        exit_code = EXIT_FAILURE;
+      }
+      entry = &stream.pending[(stream.head + stream.count) % stream.capacity]; // not touched by the writer until counted
+      pthread_mutex_unlock(&stream.lock);
+      entry->data = buffer;
+      if (exit_code != EXIT_SUCCESS) {
+        free(buffer);
+      } else if (!(entry->job = ljson_submit(pool, buffer, length, &options, NULL, NULL))) {
+        fprintf(stderr, "Could not queue %s: %s\n", name, strerror(errno));
+        exit_code = EXIT_FAILURE;
+        free(buffer);
+      } else {
+        pthread_mutex_lock(&stream.lock);
+        ++stream.count;
+        pthread_cond_signal(&stream.changed);
+        pthread_mutex_unlock(&stream.lock);
+      }
+    } else {
+      free(buffer);
+    }
+    buffer = next;
+  }
+  pthread_mutex_lock(&stream.lock);
+  stream.done = 1;
+  pthread_cond_signal(&stream.changed);
+  pthread_mutex_unlock(&stream.lock);
+  pthread_join(writer, NULL);
+  ljson_pool_destroy(pool);
+  pthread_mutex_destroy(&stream.lock);
+  pthread_cond_destroy(&stream.changed);
+  free(buffer);
+  free(stream.pending);
+  *bytes_out += stream.bytes_out;
+  return split->failed ? EXIT_FAILURE : exit_code;
+}
+
+// Minifies NDJSON into parts of about split_size bytes in output_dir, named after the file with a
+// part number. The writer finds where a part ends with one memchr from the byte where it reaches the
+// size, since the workers cannot know the offsets of their buffers in the output.
+static int do_split(char filename[]) {
+  Split split = {.fd = -1, .limit = split_size};
+  const char* base = strrchr(filename, '/') ? strrchr(filename, '/') + 1 : filename;
+  const char* extension = strrchr(base, '.') ? strrchr(base, '.') : base + strlen(base);
+  uint64_t started = metrics_path ? monotonic_ns() : 0;
+  uint64_t bytes_in = 0;
+  uint64_t bytes_out = 0;
+  char kernel_text[64];
+  int exit_code;
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
+    exit_code = EXIT_FAILURE;
+    goto record_and_return;
+  }
+  split.path = malloc(strlen(output_dir) + strlen(base) + 24);
+  split.number = split.path + sprintf(split.path, "%s/%.*s", output_dir, (int) (extension - base), base);
+  split.extension = extension;
+  exit_code = minify_stream(fd, filename, &split, &bytes_in, &bytes_out);
+  close(fd);
+  if (split.fd >= 0 && close(split.fd) < 0) {
+    fprintf(stderr, "Could not write %s: %s\n", split.path, strerror(errno));
+    exit_code = EXIT_FAILURE;
+  }
+  if (!quiet && exit_code == EXIT_SUCCESS) {
+    printf("%s: Saved %lu bytes in %lu parts%s\n", filename, (unsigned long) (bytes_in > bytes_out ? bytes_in - bytes_out : 0),
+           (unsigned long) split.part, describe_kernels(split.kernels, kernel_text));
+  }
+  free(split.path);
+
+  record_and_return:
+  if (metrics_path) {
+    record_metrics(bytes_in, bytes_out, started, exit_code != EXIT_SUCCESS);
+  }
+  return exit_code;
+}
+
+// Minifies NDJSON from standard input to standard output
+static int do_pipe(void) {
+  Split split = {.fd = STDOUT_FILENO, .limit = UINT64_MAX, .path = "standard output"};
+  uint64_t started = metrics_path ? monotonic_ns() : 0;
+  uint64_t bytes_in = 0;
+  uint64_t bytes_out = 0;
+  const int exit_code = minify_stream(STDIN_FILENO, "standard input", &split, &bytes_in, &bytes_out);
+  if (metrics_path) {
+    record_metrics(bytes_in, bytes_out, started, exit_code != EXIT_SUCCESS);
+  }
+  return exit_code;
+}
+
+// Creates the missing directories leading to path
+static void make_parents(char path[]) {
+  for (char* i = path + 1; *i; ++i) {
+    if (*i == '/') {
+      *i = 0;
+      mkdir(path, 0777);
+      *i = '/';
+    }
+  }
+}
+
+// Writes each file recorded in the bundle's index back to its path, under output_dir if given
+// Returns path with its leading slashes removed, as tar does, or NULL if it is empty or has a ".."
+// component, so that every file stays below the directory it is written to
+static char* relative_path(char path[]) {
+  size_t length;
+  path += strspn(path, "/");
+  for (char* component = path; *component; component += length + (component[length] == '/')) {
+    length = strcspn(component, "/");
+    if (length == 2 && component[0] == '.' && component[1] == '.') {
+      return NULL;
+    }
+  }
+  return *path ? path : NULL;
+}
+
+static int do_unbundle(char path[]) {
+  char* index_path = malloc(strlen(path) + 7);
+  char* line = NULL;
+  char* offset_field;
+  char* length_field;
+  char* end;
+  char* name;
+  char* relative;
+  char* out_path;
+  size_t capacity = 0;
+  uint64_t offset;
+  uint64_t length;
+  uint8_t* data;
+  struct stat sb;
+  FILE* index;
+  int fd;
+  int exit_code = EXIT_SUCCESS;
+  sprintf(index_path, "%s.index", path);
+  if ((fd = open(path, O_RDONLY)) < 0 || fstat(fd, &sb) < 0 || !(index = fopen(index_path, "r"))) {
+    fprintf(stderr, "Could not open %s: %s\n", fd < 0 ? path : index_path, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    free(index_path);
+    return EXIT_FAILURE;
+  }
+  data = sb.st_size ? mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : NULL;
+  close(fd);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "Could not map %s: %s\n", path, strerror(errno));
+    fclose(index);
+    free(index_path);
+    return EXIT_FAILURE;
+  }
+  while (getline(&line, &capacity, index) > 0) {
+    // Tabs in the path are escaped, so the last two separate the numbers
+    line[strcspn(line, "\n")] = 0;
+    offset = length = UINT64_MAX;
+    if ((length_field = strrchr(line, '\t'))) {
+      *length_field++ = 0;
+      length = strtoull(length_field, &end, 10);
+      if (*end || end == length_field) {
+        length = UINT64_MAX;
+      }
+    }
+    if (length_field && (offset_field = strrchr(line, '\t'))) {
+      *offset_field++ = 0;
+      offset = strtoull(offset_field, &end, 10);
+      if (*end || end == offset_field) {
+        offset = UINT64_MAX;
+      }
+    }
+    if (offset > (uint64_t) sb.st_size || length > sb.st_size - offset) {
+      fprintf(stderr, "Invalid entry in %s: %s\n", index_path, line);
+      exit_code = EXIT_FAILURE;
+      continue;
+    }
+    for (end = name = line; *end; ++end, ++name) {
+      if (*end == '\\' && end[1]) {
+        ++end;
+        *end = *end == 't' ? '\t' : *end == 'n' ? '\n' : *end;
+      }
+      *name = *end;
+    }
+    *name = 0;
+    if (!(relative = relative_path(line))) {
+      fprintf(stderr, "Not writing %s outside %s\n", line, output_dir ? output_dir : "the current directory");
+      exit_code = EXIT_FAILURE;
+      continue;
+    }
+    out_path = malloc(strlen(relative) + (output_dir ? strlen(output_dir) + 2 : 1));
+    sprintf(out_path, output_dir ? "%s/%s" : "%s%s", output_dir ? output_dir : "", relative);
+    make_parents(out_path);
+    if ((fd = open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666)) < 0 || write_full(fd, data + offset, length) < 0) {
+      fprintf(stderr, "Could not write %s: %s\n", out_path, strerror(errno));
+      exit_code = EXIT_FAILURE;
+    }
+    if (fd >= 0) {
+      close(fd);
+    }
+    free(out_path);
+  }
+  free(line);
+  fclose(index);
+  if (data) {
+    munmap(data, sb.st_size);
+  }
+  free(index_path);
+  return exit_code;
+}
+
+static void* serve_connection(void* arg) {
+  int fd = (int) (intptr_t) arg;
+  uint8_t header[4];
+  uint8_t* buffer = NULL; // reused for every request on this connection
+  size_t capacity = 0;
+  size_t length;
+  size_t input_length;
+  uint64_t started;
+  while (read_full(fd, header, 4) == 0) {
+    length = (size_t) header[0] << 24 | header[1] << 16 | header[2] << 8 | header[3];
+    if (length > max_request) {
+      fprintf(stderr, "Request of %lu bytes is longer than --max-request, closing the connection\n", (unsigned long) length);
+      if (metrics_path) {
+        record_metrics(0, 0, monotonic_ns(), 1);
+      }
+      break;
+    }
+    if (length > capacity) {
+      free(buffer);
+      capacity = length;
+      if (!(buffer = malloc(capacity + LJSON_PADDING))) {
+        fprintf(stderr, "Could not allocate %lu bytes\n", (unsigned long) length);
+        break;
+      }
+    }
+    if (read_full(fd, buffer, length) < 0) {
+      break;
+    }
+    started = metrics_path ? monotonic_ns() : 0;
+    input_length = length;
+    length = ljson_minify(buffer, length, &options);
+    if (metrics_path) {
+      record_metrics(input_length, length, started, 0);
+    }
+    header[0] = length >> 24;
+    header[1] = length >> 16;
+    header[2] = length >> 8;
+    header[3] = length;
+    if (write_full(fd, header, 4) < 0 || write_full(fd, buffer, length) < 0) {
+      break;
+    }
+  }
+  free(buffer);
+  close(fd);
+  return NULL;
+}
+
+static int do_serve(char path[]) {
+  struct sockaddr_un address = {0};
+  struct stat sb;
+  pthread_t thread;
+  int listener;
+  int fd;
+  if (strlen(path) >= sizeof(address.sun_path)) {
+    fprintf(stderr, "Socket path too long: %s\n", path);
+    return EXIT_FAILURE;
+  }
+  address.sun_family = AF_UNIX;
+  strcpy(address.sun_path, path);
+  if (stat(path, &sb) == 0 && S_ISSOCK(sb.st_mode)) {
+    unlink(path); // left behind by a previous server
+  }
+  listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0 || bind(listener, (struct sockaddr*) &address, sizeof(address)) < 0 || listen(listener, SOMAXCONN) < 0) {
+    fprintf(stderr, "Could not listen on %s: %s\n", path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  while (!stop_requested) {
+    if ((fd = accept(listener, NULL, NULL)) < 0) {
+      if (errno != EINTR && errno != ECONNABORTED) {
+        fprintf(stderr, "Could not accept connection: %s\n", strerror(errno));
+      }
+      continue;
+    }
+    if (pthread_create(&thread, NULL, serve_connection, (void*) (intptr_t) fd) != 0) {
+      fprintf(stderr, "Could not create thread\n");
+      close(fd);
+      continue;
+    }
+    pthread_detach(thread);
+  }
+  close(listener);
+  unlink(path);
+  return EXIT_SUCCESS;
+}
+
+// Connects a compressor to fd when path ends in a known extension, returning the descriptor to use
+static int compression_filter(const char path[], int fd, int writing, pid_t* child) {
+  size_t length = strlen(path);
+  const char* program = NULL;
+  int pipe_fds[2];
+  if ((length > 3 && strcmp(path + length - 3, ".gz") == 0) || (length > 4 && strcmp(path + length - 4, ".tgz") == 0)) {
+    program = "gzip";
+  } else if ((length > 4 && strcmp(path + length - 4, ".zst") == 0) || (length > 5 && strcmp(path + length - 5, ".tzst") == 0)) {
+    program = "zstd";
+  }
+  *child = 0;
+  if (!program) {
+    return fd;
+  }
+  if (pipe(pipe_fds) < 0 || (*child = fork()) < 0) {
+    fprintf(stderr, "Could not start %s: %s\n", program, strerror(errno));
+    return -1;
+  }
+  if (*child == 0) {
+    dup2(writing ? pipe_fds[0] : fd, STDIN_FILENO);
+    dup2(writing ? fd : pipe_fds[1], STDOUT_FILENO);
+    close(pipe_fds[0]);
+    close(pipe_fds[1]);
+    execlp(program, program, "-q", writing ? "-c" : "-dc", (char*) NULL);
+    fprintf(stderr, "Could not run %s: %s\n", program, strerror(errno));
+    _exit(EXIT_FAILURE);
+  }
+  close(fd);
+  close(writing ? pipe_fds[0] : pipe_fds[1]);
+  return writing ? pipe_fds[1] : pipe_fds[0];
+}
+
+static uint64_t tar_number(const uint8_t* field, size_t length) {
+  uint64_t value = 0;
+  if (*field & 0x80) { // base-256, used by GNU tar for large values
+    value = *field & 0x7F;
+    for (size_t i = 1; i < length; ++i) {
+      value = value << 8 | field[i];
+    }
+    return value;
+  }
+  for (size_t i = 0; i < length && (field[i] == ' ' || (field[i] >= '0' && field[i] <= '7')); ++i) {
+    if (field[i] != ' ') {
+      value = value << 3 | (field[i] - '0');
+    }
+  }
+  return value;
+}
+
+static void tar_set_size(uint8_t header[], uint64_t size) {
+  uint64_t checksum = 0;
+  if (size < 077777777777ULL) {
+    snprintf((char*) header + 124, 12, "%011" PRIo64, size);
+  } else {
+    header[124] = 0x80;
+    for (int i = 11; i > 0; --i, size >>= 8) {
+      header[124 + i] = size;
+    }
+  }
+  memset(header + 148, ' ', 8);
+  for (int i = 0; i < 512; ++i) {
+    checksum += header[i];
+  }
+  snprintf((char*) header + 148, 8, "%06" PRIo64, checksum);
+}
+
+// Copy a tar archive, minifying .json members on the way. Member headers are rewritten with the new
+// sizes and checksums, and everything else is copied as is.
+static int do_tar(char in_path[], char out_path[]) {
+  uint8_t header[512];
+  uint8_t* buffer = NULL;
+  size_t capacity = 0;
+  char* name = NULL;      // from a GNU long name or pax path record, for the next member
+  int keep_size = 0;      // the next member's size comes from a pax record, so it must not change
+  uint64_t size;
+  uint64_t padded;
+  uint64_t length;
+  uint64_t started;
+  unsigned kernels;
+  char kernel_text[64];
+  char full_name[257];
+  char* record;
+  char* key;
+  size_t record_length;
+  pid_t in_child = 0;
+  pid_t out_child = 0;
+  int status;
+  int exit_code = EXIT_SUCCESS;
+  int in = strcmp(in_path, "-") ? open(in_path, O_RDONLY) : STDIN_FILENO;
+  int out = strcmp(out_path, "-") ? open(out_path, O_WRONLY | O_CREAT | O_TRUNC, 0666) : STDOUT_FILENO;
+  if (in < 0 || out < 0) {
+    fprintf(stderr, "Could not open %s: %s\n", in < 0 ? in_path : out_path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  in = in == STDIN_FILENO ? in : compression_filter(in_path, in, 0, &in_child);
+  out = out == STDOUT_FILENO ? out : compression_filter(out_path, out, 1, &out_child);
+  if (in < 0 || out < 0) {
+    return EXIT_FAILURE;
+  }
+  while (read_full(in, header, 512) == 0) {
+    if (header[0] == 0) {
+      break; // end-of-archive marker
+    }
+    size = tar_number(header + 124, 12);
+    padded = (size + 511) & ~(uint64_t) 511;
+    if (name) {
+      snprintf(full_name, sizeof(full_name), "%s", name);
+    } else if (memcmp(header + 257, "ustar", 5) == 0 && header[345]) {
+      snprintf(full_name, sizeof(full_name), "%.155s/%.100s", (char*) header + 345, (char*) header);
+    } else {
+      snprintf(full_name, sizeof(full_name), "%.100s", (char*) header);
+    }
+    if (padded > capacity) {
+      free(buffer);
+      capacity = padded > 1 << 20 ? padded : 1 << 20;
+      if (!(buffer = malloc(capacity + LJSON_PADDING))) {
+        fprintf(stderr, "Could not allocate %lu bytes\n", (unsigned long) capacity);
+        exit_code = EXIT_FAILURE;
+        break;
+      }
+    }
+    if (read_full(in, buffer, padded) < 0) {
+      fprintf(stderr, "Unexpected end of archive in %s\n", full_name);
+      exit_code = EXIT_FAILURE;
+      break;
+    }
+    if ((header[156] == '0' || header[156] == 0 || header[156] == '7') && !keep_size && is_json_name(name ? name : full_name)) {
+      started = metrics_path ? monotonic_ns() : 0;
+      length = minify_buffer(buffer, size, &options, &kernels);
+      memset(buffer + length, 0, ((length + 511) & ~(uint64_t) 511) - length);
+      tar_set_size(header, length);
+      if (!quiet) {
+        fprintf(out == STDOUT_FILENO ? stderr : stdout, "%s: Saved %lu bytes%s\n", full_name, (unsigned long) (size - length),
+                describe_kernels(kernels, kernel_text));
+      }
+      if (metrics_path) {
+        record_metrics(size, length, started, 0);
+      }
+      padded = (length + 511) & ~(uint64_t) 511;
+    }
+    if (header[156] != 'L' && header[156] != 'x') {
+      free(name);
+      name = NULL;
+      keep_size = 0;
+    } else if (header[156] == 'L') {
+      free(name);
+      name = strndup((char*) buffer, size);
+    } else {
+      // pax records are "LENGTH key=value\n"
+      for (record = (char*) buffer; record < (char*) buffer + size; record += record_length) {
+        record_length = strtoul(record, &key, 10);
+        if (!record_length || record + record_length > (char*) buffer + size || *key++ != ' ') {
+          break;
         }
-        break;
-      case 't':
-        do_literal(file, "true", 4);
-        comma_ok = 1;
-        break;
-      case 'f':
-        do_literal(file, "false", 5);
-        comma_ok = 1;
-        break;
-      case 'n':
-        do_literal(file, "null", 4);
-        comma_ok = 1;
-        break;
-      case '-':
-      case '0':
-      case '1':
-      case '2':
-      case '3':
-      case '4':
-      case '5':
-      case '6':
-      case '7':
-      case '8':
-      case '9':
-        do_number(file);
-        comma_ok = 1;
-        break;
-      case '\n':
-        switch (line_start) {
-          case 1:
-            --line_start;
-            // fallthrough
-          case 2:
-            ++(file->rindex);
-            break;
-          default:
-            write_data(file, 1);
+        if (strncmp(key, "path=", 5) == 0) {
+          free(name);
+          name = strndup(key + 5, record + record_length - 1 - (key + 5));
+        } else if (strncmp(key, "size=", 5) == 0) {
+          keep_size = 1;
         }
-        break;
-      default: // invalid or whitespace
-        write_data(file, 1);
+      }
+    }
+    if (write_full(out, header, 512) < 0 || write_full(out, buffer, padded) < 0) {
+      fprintf(stderr, "Could not write %s: %s\n", out_path, strerror(errno));
+      exit_code = EXIT_FAILURE;
+      break;
     }
   }
-  free(parent_types.bits);
-  return 0;
+  memset(header, 0, 512);
+  if (exit_code == EXIT_SUCCESS && (write_full(out, header, 512) < 0 || write_full(out, header, 512) < 0)) {
+    fprintf(stderr, "Could not write %s: %s\n", out_path, strerror(errno));
+    exit_code = EXIT_FAILURE;
+  }
+  free(buffer);
+  free(name);
+  while (read(in, header, 512) > 0); // let a decompressor finish
+  close(in);
+  close(out);
+  if ((in_child && (waitpid(in_child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status))) ||
+      (out_child && (waitpid(out_child, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status)))) {
+    fprintf(stderr, "Compressor failed\n");
+    exit_code = EXIT_FAILURE;
+  }
+  return exit_code;
 }
 
-int do_dir(char path[]) {
-  DIR *dir;
-  struct dirent *entry;
-  dir = opendir(path);
-  if (!dir) {
-    fprintf(stderr, "Could not open %s: %s\n", path, strerror(errno));
+#ifdef __linux__
+// Minify ring slots in place as producers fill them. See shmring.h for the protocol.
+static int do_shm(char path[]) {
+  char* full_path = path;
+  struct stat sb;
+  RingHeader* ring;
+  RingSlot* slot;
+  uint64_t started;
+  uint64_t input_length;
+  int fd;
+  int exit_code = EXIT_SUCCESS;
+  if (!strchr(path, '/')) {
+    full_path = malloc(strlen(path) + 10);
+    sprintf(full_path, "/dev/shm/%s", path);
+  }
+  fd = open(full_path, O_RDWR);
+  if (fd < 0 || fstat(fd, &sb) < 0) {
+    fprintf(stderr, "Could not open %s: %s\n", full_path, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+    }
+    exit_code = EXIT_FAILURE;
+    goto free_path_and_return;
+  }
+  ring = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ring == MAP_FAILED) {
+    fprintf(stderr, "Could not map %s: %s\n", full_path, strerror(errno));
+    exit_code = EXIT_FAILURE;
+    goto free_path_and_return;
+  }
+  if ((size_t) sb.st_size < sizeof(RingHeader) || ring->magic != RING_MAGIC || ring->slot_count < RING_MIN_SLOTS || ring->slot_stride <= sizeof(RingSlot) + RING_PADDING ||
+      (uint64_t) sb.st_size < ring_size(ring->slot_count, ring_capacity(ring))) {
+    fprintf(stderr, "%s is not an initialized ring\n", full_path);
+    exit_code = EXIT_FAILURE;
+    goto unmap_and_return;
+  }
+  atomic_thread_fence(memory_order_acquire);
+  for (uint64_t ticket = atomic_load(&ring->tail);; ++ticket) {
+    slot = ring_slot(ring, ticket);
+    if (ring_wait(ring, slot, ticket + 1, &ring->ready_signal, &ring->ready_waiters) < 0) {
+      break;
+    }
+    started = metrics_path ? monotonic_ns() : 0;
+    input_length = slot->length;
+    if (slot->length <= ring_capacity(ring)) {
+      slot->length = ljson_minify(slot->data, slot->length, &options);
+    }
+    if (metrics_path) {
+      record_metrics(input_length, slot->length, started, input_length > ring_capacity(ring));
+    }
+    atomic_store(&ring->tail, ticket + 1);
+    atomic_store_explicit(&slot->sequence, ticket + 2, memory_order_release);
+    ring_signal(&ring->done_signal, &ring->done_waiters);
+  }
+
+  unmap_and_return:
+  munmap(ring, sb.st_size);
+  free_path_and_return:
+  if (full_path != path) {
+    free(full_path);
+  }
+  return exit_code;
+}
+
+typedef struct WatchedDir {
+  char* path;
+  size_t relative_start;
+} WatchedDir;
+
+typedef struct Seen {
+  dev_t dev;
+  ino_t ino;
+  off_t size;
+  struct timespec mtime;
+} Seen;
+
+typedef struct Watch {
+  int fd;
+  WatchedDir* dirs; // indexed by watch descriptor
+  size_t dir_count;
+  char** roots;
+  size_t root_count;
+  FoundFile* pending;
+  size_t pending_count;
+  size_t pending_size;
+  Seen seen[WATCH_SEEN];
+} Watch;
+
+static void watch_queue(Watch* watch, const char dir[], const char name[], size_t relative_start) {
+  char* path = malloc(strlen(dir) + strlen(name) + 2);
+  sprintf(path, "%s/%s", dir, name);
+  if (!in_shard(path + relative_start)) {
+    free(path);
+    return;
+  }
+  if (watch->pending_count == watch->pending_size) {
+    watch->pending_size = watch->pending_size ? watch->pending_size * 2 : 64;
+    watch->pending = realloc(watch->pending, watch->pending_size * sizeof(FoundFile));
+  }
+  watch->pending[watch->pending_count++] = (FoundFile) {path, relative_start, 0};
+}
+
+// Registers path and its subdirectories, optionally queueing the files already in them
+static int watch_dir(Watch* watch, char path[], size_t relative_start, int queue) {
+  DIR* dir;
+  struct dirent* entry;
+  char* child;
+  int wd = inotify_add_watch(watch->fd, path, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE | IN_ONLYDIR);
+  if (wd < 0) {
+    fprintf(stderr, "Could not watch %s: %s\n", path, strerror(errno));
     return EXIT_FAILURE;
   }
-  chdir(path);
+  if ((size_t) wd >= watch->dir_count) {
+    watch->dirs = realloc(watch->dirs, (wd + 64) * sizeof(WatchedDir));
+    memset(watch->dirs + watch->dir_count, 0, (wd + 64 - watch->dir_count) * sizeof(WatchedDir));
+    watch->dir_count = wd + 64;
+  }
+  if (!watch->dirs[wd].path) {
+    watch->dirs[wd].path = strdup(path);
+    watch->dirs[wd].relative_start = relative_start;
+  }
+  if (!(dir = opendir(path))) {
+    return EXIT_SUCCESS; // removed already; IN_IGNORED will clean up
+  }
   while ((entry = readdir(dir)) != NULL) {
     if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
       continue;
     }
     if (entry->d_type == DT_DIR) {
-      do_dir(entry->d_name);
-      chdir("..");
-    } else if (strstr(entry->d_name, ".json") - entry->d_name == strlen(entry->d_name) - 5) {
-      do_file(entry->d_name);
+      child = malloc(strlen(path) + strlen(entry->d_name) + 2);
+      sprintf(child, "%s/%s", path, entry->d_name);
+      watch_dir(watch, child, relative_start, queue);
+      free(child);
+    } else if (queue && is_json_name(entry->d_name)) {
+      watch_queue(watch, path, entry->d_name, relative_start);
     }
   }
   closedir(dir);
   return EXIT_SUCCESS;
 }
 
-int do_file(char filename[]) {
-  File file = {0};
-  int fd;
-  struct stat sb = {0};
-  int exit_code = EXIT_SUCCESS;
-  fd = open(filename, O_RDWR); 
-  if (fd < 0) {
-    fprintf(stderr, "Could not open %s: %s\n", filename, strerror(errno));
-    exit_code = EXIT_FAILURE;
-    goto close_descriptors_and_return;
+static Seen* watch_seen(Watch* watch, const struct stat* sb) {
+  return &watch->seen[(sb->st_ino ^ sb->st_dev) % WATCH_SEEN];
+}
+
+static int compare_paths(const void* a, const void* b) {
+  return strcmp(((const FoundFile*) a)->path, ((const FoundFile*) b)->path);
+}
+
+// Minifies the files changed since the last flush on the pool, then remembers them as they are now
+static void watch_flush(Watch* watch) {
+  struct stat sb;
+  Seen* seen;
+  FoundFile* found;
+  qsort(watch->pending, watch->pending_count, sizeof(FoundFile), compare_paths);
+  for (size_t i = 0; i < watch->pending_count; ++i) {
+    found = &watch->pending[i];
+    if ((i + 1 < watch->pending_count && strcmp(found->path, watch->pending[i + 1].path) == 0) || stat(found->path, &sb) < 0) {
+      free(found->path);
+      found->path = NULL;
+      continue;
+    }
+    seen = watch_seen(watch, &sb);
+    // Closing the file after minifying it raises another event, which must not loop
+    if (seen->dev != sb.st_dev || seen->ino != sb.st_ino || seen->size != sb.st_size ||
+        seen->mtime.tv_sec != sb.st_mtim.tv_sec || seen->mtime.tv_nsec != sb.st_mtim.tv_nsec) {
+      queue_file(found->path, found->relative_start);
+    } else {
+      free(found->path);
+      found->path = NULL;
+    }
   }
-  if (!quiet) {
-    printf("%s: ", filename);
+  finish_queue();
+  for (size_t i = 0; i < watch->pending_count; ++i) {
+    found = &watch->pending[i];
+    if (found->path && stat(found->path, &sb) == 0) {
+      seen = watch_seen(watch, &sb);
+      seen->dev = sb.st_dev;
+      seen->ino = sb.st_ino;
+      seen->size = sb.st_size;
+      seen->mtime = sb.st_mtim;
+    }
+    free(found->path);
   }
-  fstat(fd, &sb);
-  file.data_start = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-  if (file.data_start == MAP_FAILED) {
-    fprintf(stderr, "Could not map file\n");
-    exit_code = EXIT_FAILURE;
-    goto close_descriptors_and_return;
+  watch->pending_count = 0;
+  if (state_path) {
+    save_progress();
   }
-  file.rindex = file.windex = file.lindex = file.data_start;
-  file.data_end = file.data_start + sb.st_size;
-  if (file.data_end - file.data_start > 2 && (*file.data_start == 0 || *(file.data_start + 1) == 0)) {
-    fprintf(stderr, "Only UTF-8 input is currently supported\n");
-    exit_code = EXIT_FAILURE;
-    goto close_descriptors_and_return;
+  if (manifest) {
+    fflush(manifest);
   }
-  do_value(&file, newlines == 2 ? 2 : 0); // clean up leading newlines in -n mode
-  if (newlines) {
-    while (file.rindex < file.data_end) {  
-      do_value(&file, newlines);
+  fflush(stdout);
+}
+
+static void watch_event(Watch* watch, const struct inotify_event* event) {
+  WatchedDir* dir;
+  char* child;
+  if (event->mask & IN_Q_OVERFLOW) {
+    fprintf(stderr, "Watch queue overflowed; rescanning\n");
+    for (size_t i = 0; i < watch->root_count; ++i) {
+      watch_dir(watch, watch->roots[i], strlen(watch->roots[i]) + 1, 1);
     }
+    return;
   }
-  write_data(&file, 0);
-  if (newlines == 1 && file.windex > file.data_start && *(file.windex - 1) == '\n') {
-    --(file.windex); // clean up trailing newline in -n mode
+  if (event->wd < 0 || (size_t) event->wd >= watch->dir_count || !(dir = &watch->dirs[event->wd])->path) {
+    return;
   }
-  if (msync(file.data_start, file.windex - file.data_start, MS_SYNC) < 0) {
-    fprintf(stderr, "Could not sync file: %s\n", strerror(errno));
-    exit_code = EXIT_FAILURE;
-    goto close_descriptors_and_return;
+  if (event->mask & IN_IGNORED) {
+    free(dir->path);
+    dir->path = NULL;
+  } else if (event->mask & IN_ISDIR) {
+    // Files may have been written before the new directory was watched
+    child = malloc(strlen(dir->path) + strlen(event->name) + 2);
+    sprintf(child, "%s/%s", dir->path, event->name);
+    watch_dir(watch, child, dir->relative_start, 1);
+    free(child);
+  } else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO) && event->len && is_json_name(event->name)) {
+    watch_queue(watch, dir->path, event->name, dir->relative_start);
   }
-  if (!quiet) {
-    printf("Saved %lu bytes\n", (unsigned long) (file.data_end - file.windex));
+}
+
+// Releases the watches, the directories they name and any files still pending, returning exit_code
+static int close_watch(Watch* watch, int exit_code) {
+  for (size_t i = 0; i < watch->pending_count; ++i) {
+    free(watch->pending[i].path);
   }
+  for (size_t i = 0; i < watch->dir_count; ++i) {
+    free(watch->dirs[i].path);
+  }
+  free(watch->pending);
+  free(watch->dirs);
+  close(watch->fd);
+  return exit_code;
+}
 
-  close_descriptors_and_return:
-  if (file.data_start != 0 && file.data_start != MAP_FAILED) {
-    munmap(file.data_start, sb.st_size);
+static int do_watch(char* paths[], size_t path_count) {
+  Watch watch = {0};
+  struct pollfd pfd;
+  char buffer[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+  ssize_t length;
+  watch.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (watch.fd < 0) {
+    fprintf(stderr, "Could not initialize inotify: %s\n", strerror(errno));
+    return EXIT_FAILURE;
   }
-  if (fd >= 0) {
-    // We truncate the file here because Cygwin mmap implementation opens a new file descriptor,
-    // and ftruncate fails if that descriptor is open with a "Permission denied" error
-    if (exit_code == EXIT_SUCCESS && ftruncate(fd, file.windex - file.data_start) < 0) {
-      fprintf(stderr, "Could not truncate file to new size: %s. It may have garbage characters at the end\n", strerror(errno));
+  watch.roots = paths;
+  watch.root_count = path_count;
+  for (size_t i = 0; i < path_count; ++i) {
+    // Paths below a root are joined with a slash, and relative_start must skip exactly one
+    for (size_t length = strlen(paths[i]); length > 1 && paths[i][length - 1] == '/'; --length) {
+      paths[i][length - 1] = '\0';
+    }
+    if (watch_dir(&watch, paths[i], strlen(paths[i]) + 1, 1) != EXIT_SUCCESS) {
+      return close_watch(&watch, EXIT_FAILURE);
     }
-    close(fd);
   }
-  return exit_code;
+  pfd.fd = watch.fd;
+  pfd.events = POLLIN;
+  while (!stop_requested) {
+    if (watch.pending_count >= WATCH_BATCH || (poll(&pfd, 1, watch.pending_count ? WATCH_DEBOUNCE_MS : -1) == 0 && watch.pending_count)) {
+      watch_flush(&watch);
+      continue;
+    }
+    while ((length = read(watch.fd, buffer, sizeof(buffer))) > 0) {
+      for (char* event = buffer; event < buffer + length; event += sizeof(struct inotify_event) + ((struct inotify_event*) event)->len) {
+        watch_event(&watch, (struct inotify_event*) event);
+      }
+      if (watch.pending_count >= WATCH_BATCH) {
+        break;
+      }
+    }
+    if (length < 0 && errno != EAGAIN && errno != EINTR) {
+      fprintf(stderr, "Could not read events: %s\n", strerror(errno));
+      return close_watch(&watch, EXIT_FAILURE);
+    }
+  }
+  watch_flush(&watch);
+  return close_watch(&watch, EXIT_SUCCESS);
+}
+#else
+static int do_shm(char path[]) {
+  fprintf(stderr, "Shared-memory mode requires futexes\n");
+  return EXIT_FAILURE;
+}
+
+static int do_watch(char* paths[], size_t path_count) {
+  fprintf(stderr, "Watch mode requires inotify\n");
+  return EXIT_FAILURE;
+}
+#endif
+
+// Parses a byte count with an optional K, M or G suffix, failing if it does not fit in 64 bits. 0 is
+// accepted, since it turns --readahead and --stream-threshold off; options that need a positive size
+// check for it themselves.
+static int parse_size(const char text[], uint64_t* size) {
+  char* end;
+  int shift;
+  if (*text < '0' || *text > '9') {
+    return -1;
+  }
+  errno = 0;
+  *size = strtoull(text, &end, 10);
+  if (errno == ERANGE || (*end && (!strchr("KMG", *end) || end[1]))) {
+    return -1;
+  }
+  shift = *end == 'K' ? 10 : *end == 'M' ? 20 : *end == 'G' ? 30 : 0;
+  if (*size > UINT64_MAX >> shift) {
+    return -1;
+  }
+  *size <<= shift;
+  return 0;
 }
 
-void usage(char progname[], int status) {
+static void usage(char progname[], int status) {
   fprintf(EXIT_SUCCESS ? stdout : stderr,
-          "Usage: %s [options] path\n"
+          "Usage: %s [options] path...\n"
           "JSON minifier\n"
           "Options:\n"
           "  -p N Numeric precision (number of decimal places; can be negative)\n"
-          "  -n   Process NDJSON/JSON Lines\n"
+          "  -n   Process NDJSON/JSON Lines; a path of - streams stdin to stdout\n"
           "  -N   Process NDJSON, preserving empty lines\n"
-          "  -q   Suppress output\n", progname);
+          "  -q   Suppress output\n"
+          "  -o DIR Output directory for --columns, --unbundle and --split-size\n"
+          "  -w, --whitespace-only  Only remove whitespace, leaving numbers and escapes as they are\n"
+          "  --float32[=KEYS]   Round non-integer numbers to float32, optionally only under KEYS (a,b.c)\n"
+          "  --stream-threshold BYTES  In files of 32 MiB or more, move spans this long (K, M, G) past the cache (0: never)\n"
+          "  --files-from FILE  Also process NUL-separated paths read from FILE (- for stdin)\n"
+          "  --shard I/N        Only process files whose relative path hashes to shard I of N\n"
+          "  --manifest FILE    Write the relative path and bytes in and out of each file to FILE, for tools/mergeshards.js\n"
+          "  --watch            Process the directories, then keep minifying files as they are written\n"
+          "  --incremental STATEFILE  With -n or -N, only minify lines appended since the last run\n"
+          "  --serve SOCKET     Minify length-prefixed requests on a Unix socket\n"
+          "  --max-request BYTES  With --serve, close connections that send a longer request (K, M, G; default 64M)\n"
+          "  --shm RING         Minify the slots of a shared-memory ring in place (name in /dev/shm or path)\n"
+          "  --metrics-file PATH  Write Prometheus metrics to PATH, periodically in long-running modes\n"
+          "  --tar IN OUT       Copy a tar archive (- for stdin/stdout; .gz/.zst compressed), minifying .json members\n"
+          "  --get POINTER      Print the minified value at a JSON Pointer such as /a/0/b, leaving the files unchanged\n"
+          "  --schema[=FILE]    With -n or -N, expect lines to have FILE's JSON Schema properties in order, or the layout of earlier lines\n"
+          "  --columns LIST     With -n or -N, write the values at comma-separated JSON Pointers to a file each in -o DIR\n"
+          "  --bundle OUT       Write the minified files to OUT, one per line, with an index of their paths in OUT.index\n"
+          "  --unbundle BUNDLE  Write the files in BUNDLE back to their paths, under -o DIR if given\n"
+          "  --readahead BYTES  Start reading the next files found in directories and lists, up to BYTES ahead (K, M, G; default 64M, 0: off)\n"
+          "  --split-size N     With -n or -N, write the minified lines to parts of about N bytes (K, M, G) in -o DIR\n"
+          "  --build-index      Also write an index of each file's structure to FILE.idx for --query\n"
+          "  --query POINTER    Like --get, but look the pointer up in FILE.idx; a last token START:END slices an array\n", progname);
   exit(status);
 }
 
 int main(int argc, char* argv[]) {
-  struct stat sb;
+  static const struct option long_options[] = {
+    {"whitespace-only", no_argument, NULL, 'w'},
+    {"files-from", required_argument, NULL, 'f'},
+    {"shard", required_argument, NULL, 's'},
+    {"watch", no_argument, NULL, 'W'},
+    {"incremental", required_argument, NULL, 'i'},
+    {"serve", required_argument, NULL, 'S'},
+    {"shm", required_argument, NULL, 'R'},
+    {"metrics-file", required_argument, NULL, 'M'},
+    {"manifest", required_argument, NULL, 'm'},
+    {"tar", required_argument, NULL, 't'},
+    {"float32", optional_argument, NULL, 'F'},
+    {"stream-threshold", required_argument, NULL, 'T'},
+    {"get", required_argument, NULL, 'g'},
+    {"build-index", no_argument, NULL, 'I'},
+    {"query", required_argument, NULL, 'Q'},
+    {"schema", optional_argument, NULL, 'K'},
+    {"columns", required_argument, NULL, 'C'},
+    {"bundle", required_argument, NULL, 'B'},
+    {"unbundle", required_argument, NULL, 'U'},
+    {"split-size", required_argument, NULL, 'Z'},
+    {"readahead", required_argument, NULL, 'A'},
+    {"max-request", required_argument, NULL, 'L'},
+    {NULL, 0, NULL, 0}
+  };
   int opt;
   int negative = 0;
-  precision = INT64_MAX;
+  int exit_code = EXIT_SUCCESS;
+  int watch = 0;
+  char* files_from = NULL;
+  char* serve = NULL;
+  char* ring = NULL;
+  char* tar = NULL;
+  char* get = NULL;
+  char* query = NULL;
+  char* column_list = NULL;
+  char* unbundle = NULL;
+  pthread_t metrics;
+  options.precision = INT64_MAX;
+  options.ndjson = 0;
+  options.whitespace_only = 0;
   quiet = 0;
-  newlines = 0;
+  shard_index = 0;
+  shard_count = 1;
+  state_path = NULL;
   char* i;
-  while ((opt = getopt(argc, argv, "h?qnNp:")) != -1) {
+  while ((opt = getopt_long(argc, argv, "h?qnNwp:o:", long_options, NULL)) != -1) {
     switch (opt) {
       case 'h':
       case '?':
@@ -743,11 +4777,98 @@ int main(int argc, char* argv[]) {
       case 'q':
         quiet = 1;
         break;
+      case 'f':
+        files_from = optarg;
+        break;
+      case 'W':
+        watch = 1;
+        break;
+      case 'w':
+        options.whitespace_only = 1;
+        break;
+      case 'F':
+        options.float32 = 1;
+        options.float32_keys = optarg;
+        break;
+      case 'i':
+        state_path = optarg;
+        break;
+      case 'T':
+        if (parse_size(optarg, &stream_threshold) < 0) {
+          fprintf(stderr, "Stream threshold must be a number of bytes, optionally followed by K, M or G\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'S':
+        serve = optarg;
+        break;
+      case 'R':
+        ring = optarg;
+        break;
+      case 'M':
+        metrics_path = optarg;
+        break;
+      case 't':
+        tar = optarg;
+        break;
+      case 'g':
+        get = optarg;
+        break;
+      case 'I':
+        build_index = 1;
+        break;
+      case 'Q':
+        query = optarg;
+        break;
+      case 'C':
+        column_list = optarg;
+        break;
+      case 'o':
+        output_dir = optarg;
+        break;
+      case 'm':
+        manifest_path = optarg;
+        break;
+      case 'B':
+        bundle_path = optarg;
+        break;
+      case 'U':
+        unbundle = optarg;
+        break;
+      case 'Z':
+        if (parse_size(optarg, &split_size) < 0 || !split_size) {
+          fprintf(stderr, "Split size must be a positive number of bytes, optionally followed by K, M or G\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'A':
+        if (parse_size(optarg, &readahead_budget) < 0) {
+          fprintf(stderr, "Readahead must be a number of bytes, optionally followed by K, M or G\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'L':
+        if (parse_size(optarg, &max_request) < 0 || !max_request) {
+          fprintf(stderr, "Maximum request must be a positive number of bytes, optionally followed by K, M or G\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'K':
+        schema_path = optarg;
+        schema.learn = !optarg;
+        break;
+      case 's':
+        shard_index = strtoull(optarg, &i, 10);
+        if (*i != '/' || !(shard_count = strtoull(i + 1, &i, 10)) || *i || shard_index >= shard_count) {
+          fprintf(stderr, "Shard must be I/N with 0 <= I < N\n");
+          exit(EXIT_FAILURE);
+        }
+        break;
       case 'n':
-        newlines = 1;
+        options.ndjson = 1;
         break;
       case 'N':
-        newlines = 2;
+        options.ndjson = 2;
         break;
       case 'p':
         if (!optarg) {
@@ -758,8 +4879,8 @@ int main(int argc, char* argv[]) {
           negative = 1;
           ++i;
         }
-        precision = 0;
-        for (; *i && precision < INT64_MAX; ++i) {
+        options.precision = 0;
+        for (; *i && options.precision < INT64_MAX; ++i) {
           switch (*i) {
             case '0':
             case '1':
@@ -771,11 +4892,11 @@ int main(int argc, char* argv[]) {
             case '7':
             case '8':
             case '9':
-              if (precision > INT64_MAX / 10 || (precision == INT64_MAX / 10 && *i > '7')) {
+              if (options.precision > INT64_MAX / 10 || (options.precision == INT64_MAX / 10 && *i > '7')) {
                 fprintf(stderr, "Precision limited to %lld\n", (long long int) INT64_MAX);
-                precision = INT64_MAX;
+                options.precision = INT64_MAX;
               }
-              precision = precision * 10 + *i - '0';
+              options.precision = options.precision * 10 + *i - '0';
               break;
             default:
               fprintf(stderr, "Precision must be an integer\n");
@@ -783,19 +4904,152 @@ int main(int argc, char* argv[]) {
           }
         }
         if (negative) {
-          precision = -precision;
+          options.precision = -options.precision;
         }
         break;
       default:
         usage(argv[0], EXIT_FAILURE);
     }
   }
-  if (argc - optind != 1) {
+  if (metrics_path && (serve || ring || watch)) {
+    pthread_create(&metrics, NULL, metrics_thread, NULL);
+    pthread_detach(metrics);
+  }
+  if (manifest_path && (serve || ring || tar || unbundle || get || query || column_list || split_size || bundle_path ||
+                        (argc - optind == 1 && !strcmp(argv[optind], "-")))) {
+    fprintf(stderr, "--manifest only applies to files minified in place\n");
+    exit(EXIT_FAILURE);
+  }
+  if (serve || watch) {
+    // Without SA_RESTART, so that accept and poll return and the mode can finish
+    struct sigaction action = {.sa_handler = request_stop};
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+  }
+  if (serve) {
+    return finish_metrics(do_serve(serve));
+  }
+  if (ring) {
+    return finish_metrics(do_shm(ring));
+  }
+  if (tar) {
+    if (argc - optind != 1) {
+      usage(argv[0], EXIT_FAILURE);
+    }
+    return finish_metrics(do_tar(tar, argv[optind]));
+  }
+  if (unbundle) {
+    if (argc != optind) {
+      usage(argv[0], EXIT_FAILURE);
+    }
+    return finish_metrics(do_unbundle(unbundle));
+  }
+  if (argc - optind == 1 && !strcmp(argv[optind], "-") && !files_from) {
+    if (!options.ndjson || get || query || column_list || split_size || bundle_path || watch || state_path || build_index ||
+        schema_path || schema.learn) {
+      fprintf(stderr, "Minifying standard input requires -n or -N and does not support other file modes\n");
+      exit(EXIT_FAILURE);
+    }
+    return finish_metrics(do_pipe());
+  }
+  if (argc == optind && !files_from) {
     usage(argv[0], EXIT_FAILURE);
   }
-  stat(argv[optind], &sb);
-  if (sb.st_mode & S_IFDIR) {
-    return do_dir(argv[optind]);
+  if (get || query) {
+    if (files_from || (get && query)) {
+      usage(argv[0], EXIT_FAILURE);
+    }
+    for (; optind < argc; ++optind) {
+      if ((get ? do_get(argv[optind], get) : do_query(argv[optind], query)) != EXIT_SUCCESS) {
+        exit_code = EXIT_FAILURE;
+      }
+    }
+    return finish_metrics(exit_code);
+  }
+  if (column_list) {
+    if (files_from || !options.ndjson || !output_dir) {
+      fprintf(stderr, "--columns requires -n or -N and -o DIR\n");
+      exit(EXIT_FAILURE);
+    }
+    exit_code = open_columns(column_list);
+    for (; exit_code == EXIT_SUCCESS && optind < argc; ++optind) {
+      exit_code = do_columns(argv[optind]);
+    }
+    return finish_metrics(close_columns() == EXIT_SUCCESS ? exit_code : EXIT_FAILURE);
+  }
+  if (split_size) {
+    if (files_from || !options.ndjson || !output_dir || bundle_path || state_path || build_index || schema_path || schema.learn) {
+      fprintf(stderr, "--split-size requires -n or -N and -o DIR, and does not support other file modes\n");
+      exit(EXIT_FAILURE);
+    }
+    for (; optind < argc; ++optind) {
+      if (do_split(argv[optind]) != EXIT_SUCCESS) {
+        exit_code = EXIT_FAILURE;
+      }
+    }
+    return finish_metrics(exit_code);
+  }
+  if (bundle_path && (watch || state_path || build_index || schema_path || schema.learn)) {
+    fprintf(stderr, "--bundle does not support --watch, --incremental, --build-index or --schema\n");
+    exit(EXIT_FAILURE);
+  }
+  if (bundle_path && open_bundle() != EXIT_SUCCESS) {
+    exit(EXIT_FAILURE);
+  }
+  if (build_index && options.ndjson) {
+    fprintf(stderr, "--build-index does not support -n or -N\n");
+    exit(EXIT_FAILURE);
+  }
+  if (schema_path || schema.learn) {
+    if (!options.ndjson || options.float32_keys) {
+      fprintf(stderr, "--schema requires -n or -N and does not support --float32=KEYS\n");
+      exit(EXIT_FAILURE);
+    }
+    if (schema_path && load_schema() < 0) {
+      fprintf(stderr, "Could not read schema %s\n", schema_path);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (state_path) {
+    if (!options.ndjson) {
+      fprintf(stderr, "--incremental requires -n or -N\n");
+      exit(EXIT_FAILURE);
+    }
+    if (load_progress() != EXIT_SUCCESS) {
+      fprintf(stderr, "Could not read %s: %s\n", state_path, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (manifest_path) {
+    if (!(manifest = fopen(manifest_path, "w"))) {
+      fprintf(stderr, "Could not create %s: %s\n", manifest_path, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    fprintf(manifest, "# shard %" PRIu64 "/%" PRIu64 "\n", shard_index, shard_count);
+  }
+  if (watch) {
+    if (files_from) {
+      usage(argv[0], EXIT_FAILURE);
+    }
+    return finish_metrics(close_manifest(do_watch(argv + optind, argc - optind)));
+  }
+  for (; optind < argc; ++optind) {
+    if (do_path(argv[optind]) != EXIT_SUCCESS) {
+      exit_code = EXIT_FAILURE;
+    }
+  }
+  if (files_from && do_files_from(files_from) != EXIT_SUCCESS) {
+    exit_code = EXIT_FAILURE;
+  }
+  if (finish_queue() != EXIT_SUCCESS) {
+    exit_code = EXIT_FAILURE;
+  }
+  if (bundle_path) {
+    exit_code = close_bundle(exit_code);
+  }
+  if (state_path && save_progress() != EXIT_SUCCESS) {
+    exit_code = EXIT_FAILURE;
   }
-  return do_file(argv[optind]);
+  return finish_metrics(close_manifest(exit_code));
 }
+#endif
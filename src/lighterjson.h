@@ -0,0 +1,81 @@
+/**
+ * @file      lighterjson.h
+ * @brief     JSON minifier library interface
+ * @author    Aaron Kaluszka
+ * @copyright Copyright 2017-2021 Aaron Kaluszka
+ *            Licensed under the Apache License, Version 2.0 (the "License");
+ *            you may not use this file except in compliance with the License.
+ *            You may obtain a copy of the License at
+ *                http://www.apache.org/licenses/LICENSE-2.0
+ *            Unless required by applicable law or agreed to in writing, software
+ *            distributed under the License is distributed on an "AS IS" BASIS,
+ *            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *            See the License for the specific language governing permissions and
+ *            limitations under the License.
+ */
+
+#ifndef LIGHTERJSON_H
+#define LIGHTERJSON_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LJSON_OK 0
+#define LJSON_CANCELLED 1
+#define LJSON_PADDING 16 // bytes past the input that must be allocated, see ljson_minify
+
+typedef struct ljson_options {
+  int64_t precision;        // decimal places to round numbers to (can be negative); INT64_MAX keeps all digits
+  int ndjson;               // 1 to process NDJSON, 2 to also preserve empty lines
+  int whitespace_only;      // only remove whitespace; numbers and escapes are left as they are
+  int float32;              // round non-integer numbers to the nearest float32
+  const char* float32_keys; // comma-separated member names or dotted paths to limit float32 to; NULL for all
+} ljson_options;
+
+typedef struct ljson_pool ljson_pool;
+typedef struct ljson_job ljson_job;
+
+// Called on a pool thread, or on the thread calling ljson_cancel, once a job finishes
+typedef void (*ljson_callback)(uint8_t* data, size_t length, int status, void* user);
+
+// Minifies length bytes at data in place and returns the new length. options may be NULL for defaults.
+// The buffer must extend LJSON_PADDING bytes past length: the first of them is set to NUL while
+// scanning and restored afterwards, and the rest may be read.
+size_t ljson_minify(uint8_t* data, size_t length, const ljson_options* options);
+
+// Creates a pool of threads (0 for one per processor) that accepts at most capacity unfinished jobs
+ljson_pool* ljson_pool_create(size_t threads, size_t capacity);
+
+// Finishes all submitted jobs, then stops the threads
+void ljson_pool_destroy(ljson_pool* pool);
+
+// Queues data for minification in place, blocking while the pool is at capacity. data must stay
+// valid until the job finishes and, as for ljson_minify, be followed by LJSON_PADDING bytes. NDJSON
+// input larger than a few megabytes is split at line boundaries and minified by several threads.
+// callback may be NULL. The returned handle must be passed to ljson_wait or ljson_release.
+ljson_job* ljson_submit(ljson_pool* pool, uint8_t* data, size_t length, const ljson_options* options,
+                        ljson_callback callback, void* user);
+
+// Like ljson_submit, but returns NULL instead of blocking when the pool is at capacity
+ljson_job* ljson_try_submit(ljson_pool* pool, uint8_t* data, size_t length, const ljson_options* options,
+                            ljson_callback callback, void* user);
+
+// Stops a job that has not finished. Parts that are already running complete, so data may be left
+// partially minified. Returns 0 if the job was cancelled, or -1 if it had already finished.
+int ljson_cancel(ljson_job* job);
+
+// Waits for a job to finish, stores the minified length, releases the handle and returns the status
+int ljson_wait(ljson_job* job, size_t* length);
+
+// Releases a handle without waiting for the job
+void ljson_release(ljson_job* job);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
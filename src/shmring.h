@@ -0,0 +1,123 @@
+/**
+ * @file      shmring.h
+ * @brief     Shared-memory ring used by lighterjson --shm and its producers
+ * @author    Aaron Kaluszka
+ * @copyright Copyright 2017-2021 Aaron Kaluszka
+ *            Licensed under the Apache License, Version 2.0 (the "License");
+ *            you may not use this file except in compliance with the License.
+ *            You may obtain a copy of the License at
+ *                http://www.apache.org/licenses/LICENSE-2.0
+ *            Unless required by applicable law or agreed to in writing, software
+ *            distributed under the License is distributed on an "AS IS" BASIS,
+ *            WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *            See the License for the specific language governing permissions and
+ *            limitations under the License.
+ *
+ * The region is a RingHeader followed by slot_count slots of slot_stride bytes. Producers claim
+ * tickets from head, so any number of them may share a ring, and the minifier completes tickets in
+ * order. A slot holding ticket t moves through these sequence values:
+ *   t                  free; the producer of t writes the payload and length
+ *   t + 1              ready; lighterjson minifies the payload in place and updates length
+ *   t + 2              done; the producer reads the result
+ *   t + slot_count     released by the producer for the next lap
+ * A ring needs at least RING_MIN_SLOTS slots: with fewer, the released value of a slot is the same as
+ * its ready or done value, and the producer and the minifier mistake one state for the other.
+ * Payload bytes never leave the slot. Waiting uses futexes on the two signal words, and a waker only
+ * makes a system call when the matching waiter count is nonzero. The region is normally a file in
+ * /dev/shm, but any shared mapping works, such as a memfd reached through /proc/PID/fd/N.
+ */
+
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#define RING_MAGIC 0x4E524A4CU // "LJRN"
+#define RING_SPIN 1024         // polls before sleeping on a futex
+#define RING_PADDING 16        // bytes after a payload that the minifier may read, as LJSON_PADDING
+#define RING_MIN_SLOTS 3
+
+typedef struct RingHeader {
+  uint32_t magic;
+  uint32_t slot_count;
+  uint64_t slot_stride;          // bytes per slot, including the RingSlot header and padding
+  _Atomic uint64_t head;         // next ticket for producers
+  _Atomic uint64_t tail;         // next ticket for the minifier
+  _Atomic uint32_t ready_signal; // bumped when a slot becomes ready
+  _Atomic uint32_t ready_waiters;
+  _Atomic uint32_t done_signal;  // bumped when a slot is done or released
+  _Atomic uint32_t done_waiters;
+  _Atomic uint32_t stop;         // set by the owner to make the minifier return
+} RingHeader;
+
+typedef struct RingSlot {
+  _Atomic uint64_t sequence;
+  uint64_t length;
+  uint8_t data[];
+} RingSlot;
+
+static inline uint64_t ring_stride(uint64_t slot_size) {
+  return (sizeof(RingSlot) + slot_size + RING_PADDING + 63) & ~(uint64_t) 63;
+}
+
+// Largest payload a slot holds
+static inline uint64_t ring_capacity(const RingHeader* ring) {
+  return ring->slot_stride - sizeof(RingSlot) - RING_PADDING;
+}
+
+static inline uint64_t ring_size(uint32_t slot_count, uint64_t slot_size) {
+  return ((sizeof(RingHeader) + 63) & ~(uint64_t) 63) + slot_count * ring_stride(slot_size);
+}
+
+static inline RingSlot* ring_slot(RingHeader* ring, uint64_t ticket) {
+  return (RingSlot*) ((uint8_t*) ring + ((sizeof(RingHeader) + 63) & ~(uint64_t) 63) + (ticket % ring->slot_count) * ring->slot_stride);
+}
+
+// Initializes a zeroed region. Returns -1 if slot_count is below RING_MIN_SLOTS.
+static inline int ring_init(RingHeader* ring, uint32_t slot_count, uint64_t slot_size) {
+  if (slot_count < RING_MIN_SLOTS) {
+    return -1;
+  }
+  ring->slot_count = slot_count;
+  ring->slot_stride = ring_stride(slot_size);
+  for (uint64_t i = 0; i < slot_count; ++i) {
+    atomic_store(&ring_slot(ring, i)->sequence, i);
+  }
+  atomic_thread_fence(memory_order_release);
+  ring->magic = RING_MAGIC;
+  return 0;
+}
+
+static inline void ring_signal(_Atomic uint32_t* signal, _Atomic uint32_t* waiters) {
+  atomic_fetch_add(signal, 1);
+  if (atomic_load(waiters)) {
+    syscall(SYS_futex, signal, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  }
+}
+
+// Waits until the slot reaches sequence, or stop is set. Returns 0 once the sequence is reached.
+static inline int ring_wait(RingHeader* ring, RingSlot* slot, uint64_t sequence, _Atomic uint32_t* signal, _Atomic uint32_t* waiters) {
+  uint32_t seen;
+  for (int i = 0; i < RING_SPIN; ++i) {
+    if (atomic_load_explicit(&slot->sequence, memory_order_acquire) == sequence) {
+      return 0;
+    }
+  }
+  for (;;) {
+    atomic_fetch_add(waiters, 1);
+    seen = atomic_load(signal);
+    if (atomic_load(&slot->sequence) == sequence || atomic_load(&ring->stop)) {
+      atomic_fetch_sub(waiters, 1);
+      return atomic_load(&slot->sequence) == sequence ? 0 : -1;
+    }
+    syscall(SYS_futex, signal, FUTEX_WAIT, seen, NULL, NULL, 0);
+    atomic_fetch_sub(waiters, 1);
+  }
+}
+
+#endif
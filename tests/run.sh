@@ -0,0 +1,369 @@
+#!/bin/sh
+# Regression cases for lighterjson. Each case minifies an input in place with the given options and
+# compares the result with the expected output.
+# Usage: sh tests/run.sh [LIGHTERJSON] [SHMBENCH]
+lighterjson=$(realpath "${1:-./lighterjson}") # absolute, for cases run from another directory
+shmbench=$2
+directory=$(mktemp -d)
+failures=0
+trap 'rm -rf "$directory"' EXIT
+
+# check OPTIONS INPUT EXPECTED
+check() {
+  printf '%s' "$2" > "$directory/case.json"
+  if ! $lighterjson -q $1 "$directory/case.json"; then
+    echo "FAIL: lighterjson $1 exited with an error on $2"
+    failures=$((failures + 1))
+    return
+  fi
+  actual=$(cat "$directory/case.json")
+  if [ "$actual" != "$3" ]; then
+    echo "FAIL: lighterjson $1 on $2: expected $3, got $actual"
+    failures=$((failures + 1))
+  fi
+}
+
+# Numbers are rewritten in their shortest form: no leading or trailing zeros, no sign on zero, and an
+# exponent only where it is shorter
+check "" '[10,100,00012,1.230,120000,1200000,123456789012345678901234567890]' \
+  '[10,100,12,1.23,12E4,12E5,123456789012345678901234567890]'
+check "" '[0,0.0,-0,-0.0,0e5,-0E-3]' '[0,0,0,0,0,0]'
+check "" '[1E+2,1e2,1e3,1e-3,0.5e1,1.5e-7,-1.5E-2,0.001,0.0001,12e10,1e400]' \
+  '[100,100,1e3,1e-3,5,15e-8,-0.015,1E-3,1E-4,12e10,1e400]'
+
+# -p rounds half up at the given decimal place, carrying into new digits, and drops a sign left on zero
+check "-p 0" '[0.5,0.4999,1.005,9.995,99.5,-0.004,1234.5678]' '[1,0,1,10,100,0,1235]'
+check "-p 2" '[0.5,0.4999,1.005,9.995,-0.004,-0.005,1234.5678,0.0049]' '[0.5,0.5,1.01,10,0,-0.01,1234.57,0]'
+check "-p -2" '[0.5,49.9,99.5,149,150,1234.5678]' '[0,0,100,100,200,1200]'
+
+# Escapes other than \u are kept, and a string cut off after a backslash is left as it is
+check "" '["a\u0041\n\/"]' '["aA\n\/"]'
+check "" '["ab\' '["ab\'
+
+# -w only removes whitespace outside strings, including across escaped quotes in strings longer than
+# the 16 bytes skipped at a time
+check "-w" '{ "a" : [ 1.50 , 0012, "x A  y" ],
+	"b" : -0.0, "c" : "a long string with \"  quoted  \" spaces and a \\" }' \
+  '{"a":[1.50,0012,"x A  y"],"b":-0.0,"c":"a long string with \"  quoted  \" spaces and a \\"}'
+
+# --float32=KEYS selects members by name or dotted path, and everything nested below them
+float=0.12345678901234568
+check "--float32=b" "{\"b\":{\"c\":$float,\"d\":[$float,{\"e\":$float}]},\"c\":$float,\"x\":{\"b\":$float}}" \
+  '{"b":{"c":0.12345679,"d":[0.12345679,{"e":0.12345679}]},"c":0.12345678901234568,"x":{"b":0.12345679}}'
+check "--float32=a.b" "{\"a\":{\"b\":{\"c\":$float}},\"b\":$float,\"x\":{\"c\":$float}}" \
+  '{"a":{"b":{"c":0.12345679}},"b":0.12345678901234568,"x":{"c":0.12345678901234568}}'
+
+# The smallest shared-memory ring, with more producers than slots, must not deadlock, and smaller
+# rings are refused
+if [ -n "$shmbench" ]; then
+  printf '{ "a" : [1, 2.50] }' > "$directory/ring.json"
+  if ! timeout 60 $shmbench $lighterjson "$directory/ring.json" 4 1000 3 > /dev/null; then
+    echo "FAIL: shmbench with 3 slots"
+    failures=$((failures + 1))
+  fi
+  if $shmbench $lighterjson "$directory/ring.json" 1 1 2 2> /dev/null; then
+    echo "FAIL: shmbench accepted 2 slots"
+    failures=$((failures + 1))
+  fi
+fi
+
+# Files minified by the pool are reported in the order they were listed, and one that fails does not
+# stop the others
+for name in c a b; do
+  printf '[ "%s" ]' $name > "$directory/$name.json"
+done
+printf '%s\0' "$directory/c.json" "$directory/a.json" "$directory/b.json" | $lighterjson --files-from - > "$directory/output"
+expected=$(printf '%s: Saved 2 bytes (kernels: generic)\n' "$directory/c.json" "$directory/a.json" "$directory/b.json")
+if [ "$(cat "$directory/output")" != "$expected" ]; then
+  echo "FAIL: --files-from: expected $expected, got $(cat "$directory/output")"
+  failures=$((failures + 1))
+fi
+printf '[ 1 ]' > "$directory/a.json"
+printf '\000[\000]' > "$directory/b.json"
+printf '[ 2 ]' > "$directory/c.json"
+if $lighterjson -q "$directory/a.json" "$directory/b.json" "$directory/c.json" 2> /dev/null ||
+   [ "$(cat "$directory/a.json" "$directory/c.json")" != '[1][2]' ]; then
+  echo "FAIL: a file that could not be minified was not reported, or stopped the others"
+  failures=$((failures + 1))
+fi
+
+# A manifest lists paths relative to the directory given, so shards run from different mount points
+# can be merged
+mkdir -p "$directory/tree/sub"
+printf '[ 1 ]' > "$directory/tree/sub/a.json"
+$lighterjson -q --manifest "$directory/manifest" "$directory/tree/"
+expected=$(printf '# shard 0/1\nsub/a.json\t5\t3')
+if [ "$(cat "$directory/manifest")" != "$expected" ]; then
+  echo "FAIL: manifest: expected $expected, got $(cat "$directory/manifest")"
+  failures=$((failures + 1))
+fi
+
+# --get prints the minified value at a JSON Pointer, with ~1 and ~0 escapes, without changing the file;
+# with -n a line without the value prints an empty line, and otherwise a missing value is an error
+printf '{ "a" : [ 1, { "b/c" : 2.50, "d~e" : "x" } ], "f" : null }' > "$directory/get.json"
+actual=$(for pointer in /a/1/b~1c /a/1/d~0e /a /f ""; do $lighterjson --get "$pointer" "$directory/get.json"; done)
+expected=$(printf '2.5\n"x"\n[1,{"b/c":2.5,"d~e":"x"}]\nnull\n{"a":[1,{"b/c":2.5,"d~e":"x"}],"f":null}')
+if [ "$actual" != "$expected" ] || [ "$(cat "$directory/get.json")" != '{ "a" : [ 1, { "b/c" : 2.50, "d~e" : "x" } ], "f" : null }' ]; then
+  echo "FAIL: --get: expected $expected, got $actual"
+  failures=$((failures + 1))
+fi
+if $lighterjson --get /g "$directory/get.json" 2> /dev/null; then
+  echo "FAIL: --get accepted a missing value"
+  failures=$((failures + 1))
+fi
+printf '{ "a" : 1 }\n{ "b" : 2 }\n{ "a" : [ 3 ] }\n' > "$directory/get.json"
+if [ "$($lighterjson -n --get /a "$directory/get.json")" != "$(printf '1\n\n[3]')" ]; then
+  echo "FAIL: --get with -n: got $($lighterjson -n --get /a "$directory/get.json")"
+  failures=$((failures + 1))
+fi
+
+# --query finds the same values as --get through an index of containers longer than 256 bytes, with
+# elements past the 16th, array slices and missing values, and refuses an index older than the file
+{
+  printf '{ "features" : ['
+  for i in $(seq 0 99); do
+    [ $i -gt 0 ] && printf ', '
+    printf '{ "id" : %d, "name" : "feature %d", "tags" : [ "t%d" ] }' $i $i $i
+  done
+  printf ' ], '
+  for i in $(seq 0 39); do
+    printf '"key%d" : %d, ' $i $i
+  done
+  printf '"last" : { "x" : true } }'
+} > "$directory/indexed.json"
+$lighterjson -q --build-index "$directory/indexed.json"
+for pointer in /features/0/id /features/17/name /features/99/tags/0 /key0 /key39 /last/x /features /features/100 /missing; do
+  if [ "$($lighterjson --query $pointer "$directory/indexed.json" 2>&1)" != "$($lighterjson --get $pointer "$directory/indexed.json" 2>&1)" ]; then
+    echo "FAIL: --query $pointer: got $($lighterjson --query $pointer "$directory/indexed.json" 2>&1)"
+    failures=$((failures + 1))
+  fi
+done
+if [ "$($lighterjson --query /features/-2: "$directory/indexed.json")" != \
+     '[{"id":98,"name":"feature 98","tags":["t98"]},{"id":99,"name":"feature 99","tags":["t99"]}]' ] ||
+   [ "$($lighterjson --query /features/31:33 "$directory/indexed.json")" != \
+     '[{"id":31,"name":"feature 31","tags":["t31"]},{"id":32,"name":"feature 32","tags":["t32"]}]' ]; then
+  echo "FAIL: --query with a slice"
+  failures=$((failures + 1))
+fi
+printf '{ "a" : [ 1, 2 ] }' > "$directory/small.json"
+$lighterjson -q --build-index "$directory/small.json"
+if [ "$($lighterjson --query /a/1 "$directory/small.json")" != 2 ]; then
+  echo "FAIL: --query on a file without indexed containers"
+  failures=$((failures + 1))
+fi
+printf ' ' >> "$directory/indexed.json"
+if $lighterjson --query /key0 "$directory/indexed.json" 2> /dev/null; then
+  echo "FAIL: --query used an index older than the file"
+  failures=$((failures + 1))
+fi
+
+# --schema=FILE gives the same output as plain -n, and lines whose members are out of order or missing
+# are counted as misses
+printf '{ "type" : "object", "properties" : { "id" : { "type" : "integer" }, "name" : { "type" : "string" }, "score" : { "type" : "number" } } }' \
+  > "$directory/schema"
+printf '{ "id" : 1, "name" : "a b", "score" : 1.50 }\n{"id":2,"name":"c","score":2.0}\n{ "name" : "d", "id" : 3 }\n{ "id" : 4 }\n' \
+  > "$directory/records.json"
+cp "$directory/records.json" "$directory/plain.json"
+$lighterjson -q -n "$directory/plain.json"
+$lighterjson -n --schema="$directory/schema" "$directory/records.json" > "$directory/output"
+if ! cmp -s "$directory/records.json" "$directory/plain.json" ||
+   [ "$(tail -n 1 "$directory/output")" != "$directory/records.json: Template matched 2 of 4 lines (50.0%)" ]; then
+  echo "FAIL: --schema=FILE: got $(cat "$directory/records.json" "$directory/output")"
+  failures=$((failures + 1))
+fi
+
+# --schema without FILE learns a template from a line, matches the following lines with the same
+# layout, and learns again from the line after one that differs
+printf '{ "id" : 1, "name" : "a", "v" : [ 1 ] }\n{ "id" : 22, "name" : "bcd", "v" : [ 2 ] }\n{ "id" : 3, "name" : "e", "v" : [ 3 ] }\n{"id":4}\n{ "id" : 5, "name" : "f", "v" : [ 5 ] }\n{ "id" : 6, "name" : "g", "v" : [ 6 ] }\n' \
+  > "$directory/records.json"
+cp "$directory/records.json" "$directory/plain.json"
+$lighterjson -q -n "$directory/plain.json"
+$lighterjson -n --schema "$directory/records.json" > "$directory/output"
+if ! cmp -s "$directory/records.json" "$directory/plain.json" ||
+   [ "$(tail -n 1 "$directory/output")" != "$directory/records.json: Template matched 3 of 6 lines (50.0%)" ]; then
+  echo "FAIL: --schema: got $(cat "$directory/records.json" "$directory/output")"
+  failures=$((failures + 1))
+fi
+
+# --columns writes a file per pointer in -o DIR, with empty lines where a value is missing and NaN in
+# :f64 columns where it is not a number, and leaves the input unchanged
+printf '{ "a" : { "zip" : "123" }, "n" : 1.50 }\n{ "n" : "x" }\n{ "a" : { "zip" : [ 1 ] }, "n" : -2 }\n' > "$directory/records.json"
+mkdir "$directory/columns"
+$lighterjson -q -n --columns /a/zip,/n:f64,/n -o "$directory/columns" "$directory/records.json"
+if [ "$(cat "$directory/columns/a.zip.ndjson")" != "$(printf '"123"\n\n[1]')" ] ||
+   [ "$(cat "$directory/columns/n.ndjson")" != "$(printf '1.5\n"x"\n-2')" ] ||
+   [ "$(od -An -tf8 "$directory/columns/n.f64" | tr -s ' \n' '  ')" != ' 1.5 nan -2 ' ] ||
+   [ "$(cat "$directory/records.json")" != "$(printf '{ "a" : { "zip" : "123" }, "n" : 1.50 }\n{ "n" : "x" }\n{ "a" : { "zip" : [ 1 ] }, "n" : -2 }')" ]; then
+  echo "FAIL: --columns"
+  failures=$((failures + 1))
+fi
+
+# --split-size writes the minified lines to parts that are closed at the first line ending past the
+# size, so that together they hold the same lines as plain -n, and refuses a size of 0
+for i in $(seq 1 10); do
+  printf '{ "i" : %d, "pad" : "xxxxxxxxxx" }\n' $i
+done > "$directory/records.json"
+cp "$directory/records.json" "$directory/plain.json"
+$lighterjson -q -n "$directory/plain.json"
+mkdir "$directory/parts"
+$lighterjson -q -n --split-size 60 -o "$directory/parts" "$directory/records.json"
+if [ "$(ls "$directory/parts" | tr '\n' ' ')" != 'records-00000.json records-00001.json records-00002.json records-00003.json ' ] ||
+   [ "$(wc -c < "$directory/parts/records-00000.json")" -ne 81 ] ||
+   [ "$(cat "$directory/parts/"*)" != "$(cat "$directory/plain.json")" ]; then
+  echo "FAIL: --split-size: got $(ls "$directory/parts")"
+  failures=$((failures + 1))
+fi
+if $lighterjson -q -n --split-size 0 -o "$directory/parts" "$directory/records.json" 2> /dev/null; then
+  echo "FAIL: --split-size accepted 0"
+  failures=$((failures + 1))
+fi
+
+# --watch (Linux only) minifies the files already there, then files written or renamed into the tree
+# later, including in new subdirectories
+if [ "$(uname)" = Linux ]; then
+  mkdir -p "$directory/watched"
+  printf '[ 1 ]' > "$directory/watched/a.json"
+  $lighterjson -q --watch "$directory/watched/" &
+  watcher=$!
+  sleep 0.5
+  mkdir "$directory/watched/new"
+  sleep 0.2
+  printf '[ 2 ]' > "$directory/watched/new/b.json"
+  printf '[ 3 ]' > "$directory/c.tmp"
+  mv "$directory/c.tmp" "$directory/watched/c.json"
+  for attempt in 1 2 3 4 5 6 7 8 9 10; do
+    [ "$(cat "$directory/watched/a.json" "$directory/watched/new/b.json" "$directory/watched/c.json")" = '[1][2][3]' ] && break
+    sleep 0.2
+  done
+  kill $watcher
+  if ! wait $watcher || [ "$(cat "$directory/watched/a.json" "$directory/watched/new/b.json" "$directory/watched/c.json")" != '[1][2][3]' ]; then
+    echo "FAIL: --watch: got $(cat "$directory/watched/a.json" "$directory/watched/new/b.json" "$directory/watched/c.json")"
+    failures=$((failures + 1))
+  fi
+fi
+
+# --incremental leaves a trailing line without a newline for the next run, compacts the lines appended
+# since onto the end of the minified prefix, and processes a replaced file in full
+printf '{ "a" : 1 }\n{ "b" : 2 }\n{ "c" ' > "$directory/log.json"
+$lighterjson -q -n --incremental "$directory/state" "$directory/log.json"
+if [ "$(cat "$directory/log.json")" != "$(printf '{"a":1}\n{"b":2}\n{ "c" ')" ]; then
+  echo "FAIL: --incremental on the first run: got $(cat "$directory/log.json")"
+  failures=$((failures + 1))
+fi
+printf ': 3 }\n{ "d" : 4 }\n' >> "$directory/log.json"
+$lighterjson -q -n --incremental "$directory/state" "$directory/log.json"
+if [ "$(cat "$directory/log.json")" != "$(printf '{"a":1}\n{"b":2}\n{"c":3}\n{"d":4}')" ]; then
+  echo "FAIL: --incremental after appending: got $(cat "$directory/log.json")"
+  failures=$((failures + 1))
+fi
+printf '{ "e" : 5 }\n' > "$directory/log.json"
+$lighterjson -q -n --incremental "$directory/state" "$directory/log.json"
+if [ "$(cat "$directory/log.json")" != '{"e":5}' ]; then
+  echo "FAIL: --incremental on a replaced file: got $(cat "$directory/log.json")"
+  failures=$((failures + 1))
+fi
+
+# --tar minifies the .json members, including one with a GNU long name, and copies the others
+# unchanged, into an archive that tar can still read, compressed here by its name
+if command -v tar > /dev/null && command -v gzip > /dev/null; then
+  long=$(printf '%0150d' 0)
+  mkdir -p "$directory/archive/$long" "$directory/extracted"
+  printf '{ "a" : [ 1, 2 ] }' > "$directory/archive/a.json"
+  printf '[ 1 ]' > "$directory/archive/$long/b.json"
+  printf 'keep  this ' > "$directory/archive/c.txt"
+  tar -cf "$directory/in.tar" -C "$directory/archive" a.json "$long/b.json" c.txt
+  if ! $lighterjson -q --tar "$directory/in.tar" "$directory/out.tar.gz" ||
+     ! tar -xzf "$directory/out.tar.gz" -C "$directory/extracted" ||
+     [ "$(cat "$directory/extracted/a.json" "$directory/extracted/$long/b.json" "$directory/extracted/c.txt")" != \
+       '{"a":[1,2]}[1]keep  this ' ]; then
+    echo "FAIL: --tar"
+    failures=$((failures + 1))
+  fi
+fi
+
+# Byte counts that do not fit in 64 bits are refused rather than wrapping around
+for size in 18446744073709551616 17179869184G; do
+  if $lighterjson -q --readahead $size "$directory/a.json" 2> /dev/null; then
+    echo "FAIL: --readahead $size was accepted"
+    failures=$((failures + 1))
+  fi
+done
+
+# --unbundle writes back what --bundle packed, below the current directory or -o DIR, with leading
+# slashes removed and paths with a .. component refused, and --bundle refuses a file that minifies to
+# more than one line
+(cd "$directory/tree" && printf '{ "b" : [ 1, 2 ] }' > sub/b.json && $lighterjson -q --bundle ../bundle sub)
+printf '/abs/c.json\t0\t3\n../d.json\t0\t3\nsub/../../e.json\t0\t3\n' >> "$directory/bundle.index"
+mkdir "$directory/unbundled"
+if (cd "$directory/unbundled" && $lighterjson --unbundle ../bundle 2> /dev/null) ||
+   [ "$(cat "$directory/unbundled/sub/a.json" "$directory/unbundled/sub/b.json" "$directory/unbundled/abs/c.json")" != \
+     '[1]{"b":[1,2]}[1]' ] || [ -e "$directory/d.json" ] || [ -e "$directory/e.json" ]; then
+  echo "FAIL: --bundle and --unbundle round trip"
+  failures=$((failures + 1))
+fi
+printf '{ "a" : 1 }\n{ "a" : 2 }\n' > "$directory/tree/sub/c.json"
+if $lighterjson -q -n --bundle "$directory/bundle" "$directory/tree" 2> /dev/null; then
+  echo "FAIL: --bundle accepted a file that minifies to more than one line"
+  failures=$((failures + 1))
+fi
+
+# With -n, a path of - streams stdin to stdout, passing on each line a slow producer writes without
+# waiting for a full buffer or the end of the input
+(printf '{ "a" : 1 }\n[ 1, 2 ]\n'; sleep 2; printf '{ "b" : 2 }') | $lighterjson -q -n - > "$directory/stream" &
+sleep 1
+if [ "$(cat "$directory/stream")" != "$(printf '{"a":1}\n[1,2]')" ]; then
+  echo "FAIL: pipe mode held back complete lines: got $(cat "$directory/stream")"
+  failures=$((failures + 1))
+fi
+wait
+if [ "$(cat "$directory/stream")" != "$(printf '{"a":1}\n[1,2]\n{"b":2}')" ]; then
+  echo "FAIL: pipe mode: got $(cat "$directory/stream")"
+  failures=$((failures + 1))
+fi
+
+# --serve replies with the minified body in the same framing, and closes a connection whose request is
+# longer than --max-request without reading it
+if command -v node > /dev/null; then
+  # request SOCKET LENGTH BODY: sends BODY after a header claiming LENGTH bytes and prints the reply, or
+  # "closed" if the server hung up first
+  request() {
+    timeout 10 node -e '
+      var socket = require("net").createConnection(process.argv[1]);
+      var header = Buffer.alloc(4);
+      var reply = Buffer.alloc(0);
+      header.writeUInt32BE(+process.argv[2], 0);
+      socket.on("connect", function () { socket.write(Buffer.concat([header, Buffer.from(process.argv[3])])); });
+      socket.on("data", function (data) {
+        reply = Buffer.concat([reply, data]);
+        if (reply.length >= 4 && reply.length >= 4 + reply.readUInt32BE(0)) {
+          console.log(reply.slice(4).toString());
+          socket.destroy();
+        }
+      });
+      socket.on("close", function () { if (!reply.length) console.log("closed"); });
+      socket.on("error", function () {});
+    ' "$1" "$2" "$3"
+  }
+  $lighterjson --serve "$directory/socket" --max-request 1K 2> /dev/null &
+  server=$!
+  for attempt in 1 2 3 4 5 6 7 8 9 10; do
+    [ -S "$directory/socket" ] && break
+    sleep 0.1
+  done
+  if [ "$(request "$directory/socket" 11 '[ 1, 2.50 ]')" != '[1,2.5]' ]; then
+    echo "FAIL: --serve did not minify a request"
+    failures=$((failures + 1))
+  fi
+  if [ "$(request "$directory/socket" 2048 '[ 1 ]')" != closed ]; then
+    echo "FAIL: --serve accepted a request longer than --max-request"
+    failures=$((failures + 1))
+  fi
+  kill $server
+  wait $server
+fi
+
+if [ $failures -ne 0 ]; then
+  echo "$failures failed"
+  exit 1
+fi
+echo "All tests passed"
@@ -0,0 +1,176 @@
+// Throughput benchmark over generated corpora. Each corpus is written once to a temporary directory,
+// then copied before every run because lighterjson rewrites its input. Reports the best of the runs.
+// Usage: node bench.js LIGHTERJSON [megabytes] [runs] [corpus,...] [-- options...]
+var fs = require('fs');
+var os = require('os');
+var path = require('path');
+var spawnSync = require('child_process').spawnSync;
+var separator = process.argv.indexOf('--');
+var args = separator < 0 ? process.argv.slice(2) : process.argv.slice(2, separator);
+var binary = args[0];
+var megabytes = +(args[1] || 64);
+var runs = +(args[2] || 3);
+var variants = separator < 0 ? [[], ['-p', '6']] : [process.argv.slice(separator + 1)];
+var seed = 1;
+
+if (!binary) {
+  console.error('Usage: node bench.js LIGHTERJSON [megabytes] [runs] [corpus,...] [-- options...]');
+  process.exit(1);
+}
+
+// Deterministic, so corpora are identical between runs and builds
+function random() {
+  seed = (seed * 1103515245 + 12345) % 2147483648;
+  return seed / 2147483648;
+}
+
+function coordinate(scale) {
+  return (random() - 0.5) * scale;
+}
+
+function ring() {
+  var points = [];
+  var count = 5 + Math.floor(random() * 60);
+  for (var i = 0; i < count; ++i) {
+    points.push([coordinate(360), coordinate(180)]);
+  }
+  points.push(points[0]);
+  return [points];
+}
+
+function feature(id) {
+  return {type: 'Feature', id: id, properties: {name: 'parcel ' + id, area: random() * 1000},
+          geometry: {type: 'Polygon', coordinates: ring()}};
+}
+
+function record(id) {
+  return {id: id, name: 'user ' + id, active: random() < 0.5, score: random(), tags: ['a', 'b', 'c'],
+          address: {street: id + ' Main St', zip: String(10000 + id % 90000)}, created: 1600000000 + id};
+}
+
+function junk(length) {
+  var bytes = [];
+  for (var i = 0; i < length; ++i) {
+    bytes.push('@#%~}]:;x '[Math.floor(random() * 10)]);
+  }
+  return bytes.join('');
+}
+
+function digits(length) {
+  var bytes = [];
+  for (var i = 0; i < length; ++i) {
+    bytes.push(Math.floor(random() * 10));
+  }
+  return bytes.join('');
+}
+
+function vector() {
+  var values = [];
+  for (var i = 0; i < 128; ++i) {
+    values.push(random() * 2 - 1);
+  }
+  return values;
+}
+
+// Each corpus produces chunks until the requested size is reached
+var corpora = {
+  geojson: {
+    head: '{"type":"FeatureCollection","features":[\n', separator: ',\n', tail: '\n]}\n',
+    item: function (i) { return JSON.stringify(feature(i), null, 2); }
+  },
+  'geojson-compact': {
+    head: '{"type":"FeatureCollection","features":[', separator: ',', tail: ']}',
+    item: function (i) { return JSON.stringify(feature(i)); }
+  },
+  vectors: {
+    head: '[\n', separator: ',\n', tail: '\n]\n',
+    item: function () { return '  ' + JSON.stringify(vector()).replace(/,/g, ', '); }
+  },
+  records: {
+    head: '[\n', separator: ',\n', tail: '\n]\n',
+    item: function (i) { return JSON.stringify(record(i), null, 2); }
+  },
+  strings: {
+    head: '[', separator: ', ', tail: ']',
+    item: function (i) { return JSON.stringify({id: i, body: 'lorem ipsum dolor sit amet '.repeat(20 + i % 40)}); }
+  },
+  // Worst cases for untrusted input. Throughput on these should stay within a small factor of the others.
+  deep: {
+    head: '[', separator: ',', tail: ']',
+    item: function (i) { return i % 2 ? '['.repeat(1 << 20) + ']'.repeat(1 << 20) : '{"a":'.repeat(1 << 18) + '1' + '}'.repeat(1 << 18); }
+  },
+  'long-numbers': {
+    head: '[', separator: ',', tail: ']',
+    item: function (i) { return ['-' + digits(1 << 20), '0.' + '9'.repeat(1 << 20), '1' + '0'.repeat(1 << 20) + 'e-5', '3.' + digits(1 << 20)][i % 4]; }
+  },
+  invalid: {
+    head: '[', separator: ',', tail: ']',
+    item: function (i) { return i % 2 ? junk(1 << 16) : '{' + junk(1 << 12) + '"key"' + junk(1 << 12) + ':1}'; }
+  },
+  escapes: {
+    head: '[', separator: ',', tail: ']',
+    item: function () { return '"' + '\\u0041\\n\\"\\u00e9\\/'.repeat(4096) + '"'; }
+  }
+};
+
+var selected = args[3] ? args[3].split(',') : Object.keys(corpora);
+var directory = fs.mkdtempSync(path.join(os.tmpdir(), 'lighterjson-bench-'));
+
+function generate(name) {
+  var corpus = corpora[name];
+  var file = path.join(directory, name + '.json');
+  var fd = fs.openSync(file, 'w');
+  var size = 0;
+  var parts = [corpus.head];
+  seed = 1;
+  for (var i = 0; size < megabytes * 1048576; ++i) {
+    var item = (i ? corpus.separator : '') + corpus.item(i);
+    parts.push(item);
+    size += item.length;
+    if (parts.length >= 1024) {
+      fs.writeSync(fd, parts.join(''));
+      parts = [];
+    }
+  }
+  parts.push(corpus.tail);
+  fs.writeSync(fd, parts.join(''));
+  fs.closeSync(fd);
+  return file;
+}
+
+function run(file, options) {
+  var copy = file + '.run';
+  var best = Infinity;
+  var output = 0;
+  for (var i = 0; i < runs; ++i) {
+    fs.copyFileSync(file, copy);
+    var started = process.hrtime.bigint();
+    var result = spawnSync(binary, ['-q'].concat(options, [copy]), {stdio: 'inherit'});
+    var elapsed = Number(process.hrtime.bigint() - started) / 1e9;
+    if (result.status !== 0) {
+      console.error(binary + ' failed on ' + file);
+      process.exit(1);
+    }
+    best = Math.min(best, elapsed);
+    output = fs.statSync(copy).size;
+  }
+  fs.unlinkSync(copy);
+  return {seconds: best, output: output};
+}
+
+console.log(['corpus', 'options', 'MiB', 'ms', 'MiB/s', 'output'].join('\t'));
+selected.forEach(function (name) {
+  if (!corpora[name]) {
+    console.error('Unknown corpus ' + name + '; choose from ' + Object.keys(corpora).join(','));
+    process.exit(1);
+  }
+  var file = generate(name);
+  var size = fs.statSync(file).size;
+  variants.forEach(function (options) {
+    var result = run(file, options);
+    console.log([name, options.join(' ') || '-', (size / 1048576).toFixed(1), (result.seconds * 1000).toFixed(0),
+                 (size / 1048576 / result.seconds).toFixed(0), (100 * result.output / size).toFixed(1) + '%'].join('\t'));
+  });
+  fs.unlinkSync(file);
+});
+fs.rmdirSync(directory);
@@ -0,0 +1,193 @@
+/**
+ * @file      cachebench.c
+ * @brief     Co-tenant cache benchmark for lighterjson --stream-threshold
+ *
+ * Usage: cachebench LIGHTERJSON FILE [working set KiB] [runs] [stream threshold]
+ * A thread chases pointers through a random cycle over its working set while lighterjson minifies a
+ * copy of FILE, once with every move going through the cache (--stream-threshold 0) and once with
+ * the given threshold. Reports lighterjson's throughput and the chaser's CPU time per access, which
+ * rises as lighterjson evicts the working set.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define LINE 64
+
+typedef struct Sample {
+  uint64_t accesses;
+  uint64_t cpu_ns;
+} Sample;
+
+void** cycle;
+atomic_int measuring;
+atomic_int stopping;
+_Atomic uint64_t chased;
+_Atomic uint64_t chased_ns;
+
+uint64_t now(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// One pointer per cache line, linked in random order so that prefetchers cannot follow
+void build_cycle(size_t lines) {
+  size_t* order = malloc(lines * sizeof(size_t));
+  const size_t stride = LINE / sizeof(void*);
+  cycle = aligned_alloc(LINE, lines * LINE);
+  for (size_t i = 0; i < lines; ++i) {
+    order[i] = i;
+  }
+  for (size_t i = lines - 1; i > 0; --i) {
+    const size_t j = rand() % (i + 1);
+    const size_t swap = order[i];
+    order[i] = order[j];
+    order[j] = swap;
+  }
+  for (size_t i = 0; i < lines; ++i) {
+    cycle[order[i] * stride] = &cycle[order[(i + 1) % lines] * stride];
+  }
+  free(order);
+}
+
+void* chase(void* arg) {
+  void** p = cycle;
+  uint64_t accesses;
+  uint64_t started;
+  while (!atomic_load(&stopping)) {
+    if (!atomic_load(&measuring)) {
+      usleep(1000);
+      continue;
+    }
+    accesses = 0;
+    started = now(CLOCK_THREAD_CPUTIME_ID);
+    while (atomic_load_explicit(&measuring, memory_order_relaxed)) {
+      for (int i = 0; i < 1024; ++i) {
+        p = *p;
+      }
+      accesses += 1024;
+    }
+    atomic_store(&chased_ns, now(CLOCK_THREAD_CPUTIME_ID) - started);
+    atomic_store(&chased, accesses);
+  }
+  return p;
+}
+
+Sample measure(void) {
+  Sample sample;
+  while (!atomic_load(&chased)) {
+    usleep(1000);
+  }
+  sample.accesses = atomic_exchange(&chased, 0);
+  sample.cpu_ns = atomic_exchange(&chased_ns, 0);
+  return sample;
+}
+
+int copy_file(const char from[], const char to[]) {
+  char buffer[1 << 16];
+  ssize_t length;
+  int in = open(from, O_RDONLY);
+  int out = open(to, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if (in < 0 || out < 0) {
+    return -1;
+  }
+  while ((length = read(in, buffer, sizeof(buffer))) > 0) {
+    if (write(out, buffer, length) != length) {
+      return -1;
+    }
+  }
+  close(in);
+  return close(out);
+}
+
+int main(int argc, char* argv[]) {
+  char path[64];
+  const char* thresholds[2];
+  pthread_t thread;
+  Sample sample;
+  struct stat sb;
+  size_t lines;
+  uint64_t started;
+  uint64_t best_ns[2] = {UINT64_MAX, UINT64_MAX};
+  double best_access[2] = {0, 0};
+  double idle;
+  int runs;
+  pid_t child;
+  int status;
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s LIGHTERJSON FILE [working set KiB] [runs] [stream threshold]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  lines = (argc > 3 ? strtoul(argv[3], NULL, 10) : 4096) * 1024 / LINE;
+  runs = argc > 4 ? atoi(argv[4]) : 3;
+  thresholds[0] = "0";
+  thresholds[1] = argc > 5 ? argv[5] : "4096";
+  if (!lines || runs <= 0) {
+    fprintf(stderr, "Counts must be positive\n");
+    return EXIT_FAILURE;
+  }
+  if (stat(argv[2], &sb) < 0) {
+    fprintf(stderr, "Could not open %s: %s\n", argv[2], strerror(errno));
+    return EXIT_FAILURE;
+  }
+  snprintf(path, sizeof(path), "/tmp/lighterjson-cache-%d.json", (int) getpid());
+  build_cycle(lines);
+  pthread_create(&thread, NULL, chase, NULL);
+
+  atomic_store(&measuring, 1);
+  usleep(500000);
+  atomic_store(&measuring, 0);
+  sample = measure();
+  idle = (double) sample.cpu_ns / sample.accesses;
+
+  for (int run = 0; run < runs; ++run) {
+    for (int variant = 0; variant < 2; ++variant) {
+      if (copy_file(argv[2], path) < 0) {
+        fprintf(stderr, "Could not copy %s: %s\n", argv[2], strerror(errno));
+        unlink(path);
+        return EXIT_FAILURE;
+      }
+      atomic_store(&measuring, 1);
+      started = now(CLOCK_MONOTONIC);
+      if ((child = fork()) == 0) {
+        execl(argv[1], argv[1], "-q", "--stream-threshold", thresholds[variant], path, (char*) NULL);
+        fprintf(stderr, "Could not run %s: %s\n", argv[1], strerror(errno));
+        _exit(EXIT_FAILURE);
+      }
+      waitpid(child, &status, 0);
+      started = now(CLOCK_MONOTONIC) - started;
+      atomic_store(&measuring, 0);
+      sample = measure();
+      if (!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_SUCCESS) {
+        fprintf(stderr, "%s failed\n", argv[1]);
+        unlink(path);
+        return EXIT_FAILURE;
+      }
+      if (started < best_ns[variant]) {
+        best_ns[variant] = started;
+        best_access[variant] = (double) sample.cpu_ns / sample.accesses;
+      }
+    }
+  }
+  atomic_store(&stopping, 1);
+  pthread_join(thread, NULL);
+  unlink(path);
+
+  printf("co-tenant working set %lu KiB: %.1f ns per access when idle\n", (unsigned long) (lines * LINE / 1024), idle);
+  for (int variant = 0; variant < 2; ++variant) {
+    printf("--stream-threshold %-6s %6.0f ms  %6.0f MiB/s  co-tenant %.1f ns per access\n", thresholds[variant],
+           best_ns[variant] / 1e6, sb.st_size / 1048576.0 / (best_ns[variant] / 1e9), best_access[variant]);
+  }
+  return EXIT_SUCCESS;
+}
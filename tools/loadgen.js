@@ -0,0 +1,74 @@
+// Load generator for `lighterjson --serve`. Sends the contents of a file as every request and reports latencies.
+// Usage: node loadgen.js SOCKET FILE [connections] [requests per connection]
+var fs = require('fs');
+var net = require('net');
+var socketPath = process.argv[2];
+var body = fs.readFileSync(process.argv[3]);
+var connections = +(process.argv[4] || 8);
+var requests = +(process.argv[5] || 1000);
+var latencies = [];
+var bytesOut = 0;
+var started = process.hrtime.bigint();
+var remaining = connections;
+
+var request = Buffer.alloc(4 + body.length);
+request.writeUInt32BE(body.length, 0);
+body.copy(request, 4);
+
+function connection() {
+  var socket = net.createConnection(socketPath);
+  var pending = Buffer.alloc(0);
+  var sent = 0;
+  var sentAt;
+  function send() {
+    sentAt = process.hrtime.bigint();
+    socket.write(request);
+    ++sent;
+  }
+  socket.on('connect', send);
+  socket.on('data', function (data) {
+    pending = Buffer.concat([pending, data]);
+    while (pending.length >= 4 && pending.length >= 4 + pending.readUInt32BE(0)) {
+      bytesOut += pending.readUInt32BE(0);
+      pending = pending.subarray(4 + pending.readUInt32BE(0));
+      latencies.push(Number(process.hrtime.bigint() - sentAt) / 1000);
+      if (sent < requests) {
+        send();
+      } else {
+        socket.end();
+        if (!--remaining) {
+          report();
+        }
+      }
+    }
+  });
+  socket.on('error', function (error) {
+    console.error(error.message);
+    process.exit(1);
+  });
+}
+
+function percentile(p) {
+  return latencies[Math.min(latencies.length - 1, Math.floor(latencies.length * p))].toFixed(1);
+}
+
+function report() {
+  var seconds = Number(process.hrtime.bigint() - started) / 1e9;
+  var buckets = {};
+  latencies.sort(function (a, b) { return a - b; });
+  latencies.forEach(function (latency) {
+    var bucket = Math.pow(2, Math.ceil(Math.log2(Math.max(latency, 1))));
+    buckets[bucket] = (buckets[bucket] || 0) + 1;
+  });
+  console.log(latencies.length + " requests in " + seconds.toFixed(2) + " s: " + (latencies.length / seconds).toFixed(0) + " req/s, " +
+              (latencies.length * body.length / seconds / 1048576).toFixed(1) + " MiB/s in, " + (bytesOut / seconds / 1048576).toFixed(1) + " MiB/s out");
+  console.log("latency (us): p50 " + percentile(0.5) + "  p90 " + percentile(0.9) + "  p99 " + percentile(0.99) + "  p99.9 " + percentile(0.999) + "  max " + latencies[latencies.length - 1].toFixed(1));
+  Object.keys(buckets).sort(function (a, b) { return a - b; }).forEach(function (bucket) {
+    var share = buckets[bucket] / latencies.length;
+    console.log(("<= " + bucket).padStart(10) + " us " + String(buckets[bucket]).padStart(8) + " " + "#".repeat(Math.ceil(share * 50)));
+  });
+}
+
+for (var i = 0; i < connections; ++i) {
+  connection();
+}
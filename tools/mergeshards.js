@@ -0,0 +1,62 @@
+// Merges the manifests written by several `lighterjson --shard I/N --manifest FILE` runs into one
+// manifest with totals. Fails if a shard is missing or repeated, or if a file was processed twice.
+// Usage: node mergeshards.js shard0.manifest shard1.manifest ...
+var fs = require('fs');
+var files = {};
+var shards = {};
+var count = null;
+var problems = 0;
+var totals = {files: 0, errors: 0, bytesIn: 0, bytesOut: 0};
+
+process.argv.slice(2).forEach(function (manifest) {
+  var lines = fs.readFileSync(manifest, "utf8").split("\n");
+  var header = /^# shard (\d+)\/(\d+)$/.exec(lines[0]);
+  if (!header) {
+    console.error(manifest + " is not a lighterjson manifest");
+    ++problems;
+    return;
+  }
+  if (count !== null && +header[2] !== count) {
+    console.error(manifest + " is shard " + header[1] + " of " + header[2] + ", but other manifests have " + count + " shards");
+    ++problems;
+  }
+  count = +header[2];
+  if (shards.hasOwnProperty(header[1])) {
+    console.error(manifest + " and " + shards[header[1]] + " are both shard " + header[1]);
+    ++problems;
+  }
+  shards[header[1]] = manifest;
+  lines.slice(1).forEach(function (line) {
+    // Paths are escaped, so the last two tab-separated fields are always the sizes
+    var match = /^(.*)\t(\d+)\t(\d+|error)$/.exec(line);
+    if (!match) {
+      return;
+    }
+    if (files.hasOwnProperty(match[1])) {
+      console.error(match[1] + " was processed by both " + files[match[1]].manifest + " and " + manifest);
+      ++problems;
+      return;
+    }
+    files[match[1]] = {manifest: manifest, bytesIn: match[2], bytesOut: match[3]};
+    ++totals.files;
+    totals.bytesIn += +match[2];
+    if (match[3] === "error") {
+      ++totals.errors;
+    } else {
+      totals.bytesOut += +match[3];
+    }
+  });
+});
+for (var i = 0; count !== null && i < count; ++i) {
+  if (!shards.hasOwnProperty(i)) {
+    console.error("Shard " + i + " of " + count + " is missing");
+    ++problems;
+  }
+}
+console.log("# shard 0/1");
+Object.keys(files).sort().forEach(function (file) {
+  console.log(file + "\t" + files[file].bytesIn + "\t" + files[file].bytesOut);
+});
+console.log("# " + totals.files + " files, " + totals.errors + " errors, " + totals.bytesIn + " bytes in, " +
+            totals.bytesOut + " bytes out");
+process.exitCode = problems ? 1 : 0;
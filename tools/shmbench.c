@@ -0,0 +1,150 @@
+/**
+ * @file      shmbench.c
+ * @brief     Producer benchmark for lighterjson --shm
+ *
+ * Usage: shmbench LIGHTERJSON FILE [producers] [messages per producer] [slots]
+ * Creates a ring in /dev/shm, starts LIGHTERJSON --shm on it, and has each producer thread write FILE
+ * into a slot and wait for the minified result. Reports throughput and round-trip latency.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "../src/shmring.h"
+
+typedef struct Producer {
+  pthread_t thread;
+  uint64_t* latencies;
+  uint64_t bytes_out;
+} Producer;
+
+RingHeader* ring;
+uint8_t* payload;
+size_t payload_length;
+uint64_t messages;
+
+uint64_t now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+void* produce(void* arg) {
+  Producer* producer = arg;
+  RingSlot* slot;
+  uint64_t ticket;
+  uint64_t start;
+  for (uint64_t i = 0; i < messages; ++i) {
+    start = now();
+    ticket = atomic_fetch_add(&ring->head, 1);
+    slot = ring_slot(ring, ticket);
+    ring_wait(ring, slot, ticket, &ring->done_signal, &ring->done_waiters);
+    memcpy(slot->data, payload, payload_length); // stands in for the producer generating its payload
+    slot->length = payload_length;
+    atomic_store_explicit(&slot->sequence, ticket + 1, memory_order_release);
+    ring_signal(&ring->ready_signal, &ring->ready_waiters);
+    ring_wait(ring, slot, ticket + 2, &ring->done_signal, &ring->done_waiters);
+    producer->bytes_out += slot->length;
+    atomic_store_explicit(&slot->sequence, ticket + ring->slot_count, memory_order_release);
+    ring_signal(&ring->done_signal, &ring->done_waiters);
+    producer->latencies[i] = now() - start;
+  }
+  return NULL;
+}
+
+int compare_latencies(const void* a, const void* b) {
+  return *(const uint64_t*) a < *(const uint64_t*) b ? -1 : *(const uint64_t*) a > *(const uint64_t*) b;
+}
+
+int main(int argc, char* argv[]) {
+  char path[64];
+  struct stat sb;
+  Producer* producers;
+  uint64_t* latencies;
+  uint64_t bytes_out = 0;
+  uint64_t start;
+  double seconds;
+  size_t producer_count;
+  size_t total;
+  uint32_t slot_count;
+  pid_t child;
+  int fd;
+  if (argc < 3) {
+    fprintf(stderr, "Usage: %s LIGHTERJSON FILE [producers] [messages per producer] [slots]\n", argv[0]);
+    return EXIT_FAILURE;
+  }
+  producer_count = argc > 3 ? strtoul(argv[3], NULL, 10) : 1;
+  messages = argc > 4 ? strtoull(argv[4], NULL, 10) : 10000;
+  slot_count = argc > 5 ? strtoul(argv[5], NULL, 10) : 64;
+  if (!producer_count || !messages) {
+    fprintf(stderr, "Counts must be positive\n");
+    return EXIT_FAILURE;
+  }
+  if (slot_count < RING_MIN_SLOTS) {
+    fprintf(stderr, "A ring needs at least %d slots\n", RING_MIN_SLOTS);
+    return EXIT_FAILURE;
+  }
+  if ((fd = open(argv[2], O_RDONLY)) < 0 || fstat(fd, &sb) < 0) {
+    fprintf(stderr, "Could not open %s: %s\n", argv[2], strerror(errno));
+    return EXIT_FAILURE;
+  }
+  payload_length = sb.st_size;
+  payload = malloc(payload_length + 1);
+  if (read(fd, payload, payload_length) != (ssize_t) payload_length) {
+    fprintf(stderr, "Could not read %s\n", argv[2]);
+    return EXIT_FAILURE;
+  }
+  close(fd);
+
+  snprintf(path, sizeof(path), "/dev/shm/lighterjson-bench-%d", (int) getpid());
+  if ((fd = open(path, O_RDWR | O_CREAT | O_EXCL, 0600)) < 0 || ftruncate(fd, ring_size(slot_count, payload_length)) < 0) {
+    fprintf(stderr, "Could not create %s: %s\n", path, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  ring = mmap(NULL, ring_size(slot_count, payload_length), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (ring == MAP_FAILED) {
+    fprintf(stderr, "Could not map %s: %s\n", path, strerror(errno));
+    unlink(path);
+    return EXIT_FAILURE;
+  }
+  ring_init(ring, slot_count, payload_length);
+  if ((child = fork()) == 0) {
+    execl(argv[1], argv[1], "--shm", path, (char*) NULL);
+    fprintf(stderr, "Could not run %s: %s\n", argv[1], strerror(errno));
+    _exit(EXIT_FAILURE);
+  }
+
+  producers = calloc(producer_count, sizeof(Producer));
+  start = now();
+  for (size_t i = 0; i < producer_count; ++i) {
+    producers[i].latencies = malloc(messages * sizeof(uint64_t));
+    pthread_create(&producers[i].thread, NULL, produce, &producers[i]);
+  }
+  latencies = malloc(producer_count * messages * sizeof(uint64_t));
+  for (size_t i = 0; i < producer_count; ++i) {
+    pthread_join(producers[i].thread, NULL);
+    memcpy(latencies + i * messages, producers[i].latencies, messages * sizeof(uint64_t));
+    bytes_out += producers[i].bytes_out;
+  }
+  seconds = (now() - start) / 1e9;
+  atomic_store(&ring->stop, 1);
+  ring_signal(&ring->ready_signal, &ring->ready_waiters);
+  waitpid(child, NULL, 0);
+  unlink(path);
+
+  total = producer_count * messages;
+  qsort(latencies, total, sizeof(uint64_t), compare_latencies);
+  printf("%lu messages in %.2f s: %.0f msg/s, %.1f MiB/s in, %.1f MiB/s out\n", (unsigned long) total, seconds, total / seconds,
+         total * payload_length / seconds / 1048576, bytes_out / seconds / 1048576);
+  printf("latency (us): p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n", latencies[total / 2] / 1e3,
+         latencies[total * 9 / 10] / 1e3, latencies[total * 99 / 100] / 1e3, latencies[total * 999 / 1000] / 1e3, latencies[total - 1] / 1e3);
+  return EXIT_SUCCESS;
+}